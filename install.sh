@@ -9,7 +9,7 @@ echo "Installing ..." && \
 apt update -qq && \
 apt install -qq -y libsqlite3-dev libext2fs-dev libgtk-3-dev pkg-config && \
 make -C kernel/ && \
-gcc -DSQLITE_OMIT_LOAD_EXTENSION user/safed.c -lsqlite3 -lext2fs -o safed && \
+gcc -DSQLITE_OMIT_LOAD_EXTENSION user/safed.c -lsqlite3 -lext2fs -lpthread -o safed && \
 gcc user/cli.c -o cli && \
 gcc user/gui.c -o gui `pkg-config --cflags --libs gtk+-3.0` && \
 insmod kernel/safe.ko && \
@@ -0,0 +1,131 @@
+#include <linux/xarray.h>
+#include <linux/moduleparam.h>
+
+/*
+** Per uid accounting of crypto work, for fair sharing of the cipher pool.
+** Every byte a pool slot transforms is charged to the euid which acquired the slot, and
+** advances the virtual time of that uid by bytes / weight. While slots are free they are
+** simply taken; once callers have to wait, each released slot goes to the waiter whose
+** uid has the least virtual time, so a uid streaming a huge file cannot starve the small
+** reads of others. A uid which starts waiting is brought up to the virtual time of the
+** last grant, so idle time is not saved up as credit.
+** crypto_weight takes "uid weight" to set the share of a uid (1 by default), and
+** crypto_stats lists uid, weight, bytes transformed and waits for a slot, per uid.
+*/
+#define ACCOUNT_MAX 4096
+#define WEIGHT_MAX 1000
+
+struct crypto_account
+{
+	uid_t uid;
+	unsigned int weight;
+	atomic64_t bytes;
+	atomic64_t waits;
+	/*
+	** Under slot_lock.
+	*/
+	u64 vtime;
+};
+
+static DEFINE_XARRAY(accounts);
+static atomic_t account_count = ATOMIC_INIT(0);
+
+/*
+** Shared by every uid beyond ACCOUNT_MAX, or whose account cannot be allocated.
+*/
+static struct crypto_account other_account =
+{
+	.uid = (uid_t)-1,
+	.weight = 1,
+};
+
+static struct crypto_account * account_get(uid_t uid)
+{
+	struct crypto_account * account, * old;
+
+	account = xa_load(& accounts, uid);
+	if (account)
+	{
+		return account;
+	}
+	if (atomic_inc_return(& account_count) > ACCOUNT_MAX)
+	{
+		atomic_dec(& account_count);
+		return & other_account;
+	}
+	account = kzalloc(sizeof(struct crypto_account), GFP_KERNEL);
+	if (! account)
+	{
+		atomic_dec(& account_count);
+		return & other_account;
+	}
+	account -> uid = uid;
+	account -> weight = 1;
+	old = xa_cmpxchg(& accounts, uid, NULL, account, GFP_KERNEL);
+	if (old)
+	{
+		kfree(account);
+		atomic_dec(& account_count);
+		return xa_is_err(old) ? & other_account : old;
+	}
+
+	return account;
+}
+
+static int crypto_weight_set(const char * val, const struct kernel_param * kp)
+{
+	unsigned int uid, weight;
+
+	if (sscanf(val, "%u %u", & uid, & weight) != 2 || ! weight || weight > WEIGHT_MAX)
+	{
+		return -EINVAL;
+	}
+	WRITE_ONCE(account_get(uid) -> weight, weight);
+
+	return 0;
+}
+
+static const struct kernel_param_ops crypto_weight_ops =
+{
+	.set = crypto_weight_set,
+};
+
+module_param_cb(crypto_weight, & crypto_weight_ops, NULL, 0200);
+MODULE_PARM_DESC(crypto_weight, "Set the crypto share of a uid, as \"uid weight\"");
+
+static int crypto_stats_get(char * buffer, const struct kernel_param * kp)
+{
+	struct crypto_account * account;
+	unsigned long uid;
+	int len = 0;
+
+	xa_for_each(& accounts, uid, account)
+	{
+		len += scnprintf(buffer + len, PAGE_SIZE - len, "%u %u %lld %lld\n", account -> uid,
+			READ_ONCE(account -> weight), atomic64_read(& account -> bytes), atomic64_read(& account -> waits));
+	}
+	len += scnprintf(buffer + len, PAGE_SIZE - len, "-1 1 %lld %lld\n",
+		atomic64_read(& other_account.bytes), atomic64_read(& other_account.waits));
+
+	return len;
+}
+
+static const struct kernel_param_ops crypto_stats_ops =
+{
+	.get = crypto_stats_get,
+};
+
+module_param_cb(crypto_stats, & crypto_stats_ops, NULL, 0444);
+MODULE_PARM_DESC(crypto_stats, "Per uid crypto work: uid, weight, bytes transformed, waits for a slot");
+
+static void account_exit(void)
+{
+	struct crypto_account * account;
+	unsigned long uid;
+
+	xa_for_each(& accounts, uid, account)
+	{
+		kfree(account);
+	}
+	xa_destroy(& accounts);
+}
@@ -0,0 +1,110 @@
+#include <linux/moduleparam.h>
+#include <linux/wait.h>
+#include <linux/jiffies.h>
+
+/*
+** Admission control and circuit breaker for upcalls, so a slow or dead daemon
+** costs a bounded wait instead of stalling every protected syscall.
+** At most max_inflight upcalls are outstanding; a caller waits for a slot up to
+** upcall_timeout_ms, which also bounds the wait for the answer. After
+** breaker_threshold consecutive failures the breaker opens and upcalls fail fast;
+** once breaker_cooldown_ms has passed, a single probe is let through (half open),
+** whose outcome closes or reopens the breaker.
+** All knobs live in /sys/module/safe/parameters.
+*/
+#define BREAKER_CLOSED 0
+#define BREAKER_OPEN 1
+#define BREAKER_HALF_OPEN 2
+
+static unsigned int upcall_timeout_ms = 500;
+module_param(upcall_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(upcall_timeout_ms, "Deadline of one upcall to the daemon, in milliseconds");
+
+static unsigned int max_inflight = 1024;
+module_param(max_inflight, uint, 0644);
+MODULE_PARM_DESC(max_inflight, "Maximum number of outstanding upcalls");
+
+static unsigned int breaker_threshold = 5;
+module_param(breaker_threshold, uint, 0644);
+MODULE_PARM_DESC(breaker_threshold, "Consecutive upcall failures which open the breaker");
+
+static unsigned int breaker_cooldown_ms = 1000;
+module_param(breaker_cooldown_ms, uint, 0644);
+MODULE_PARM_DESC(breaker_cooldown_ms, "Time the breaker stays open before a probe, in milliseconds");
+
+static int breaker_state = BREAKER_CLOSED;
+module_param(breaker_state, int, 0444);
+MODULE_PARM_DESC(breaker_state, "0 closed, 1 open (failing fast), 2 half open (probing)");
+
+static atomic_t inflight = ATOMIC_INIT(0);
+static atomic_t failures = ATOMIC_INIT(0);
+static unsigned long breaker_opened;
+static DECLARE_WAIT_QUEUE_HEAD(inflight_wait);
+
+static void breaker_record(bool ok)
+{
+	if (ok)
+	{
+		atomic_set(& failures, 0);
+		if (xchg(& breaker_state, BREAKER_CLOSED) != BREAKER_CLOSED)
+		{
+			printk(KERN_NOTICE "[safe] Safe recovered!\n");
+		}
+		return;
+	}
+	if (READ_ONCE(breaker_state) == BREAKER_HALF_OPEN || atomic_inc_return(& failures) >= breaker_threshold)
+	{
+		WRITE_ONCE(breaker_opened, jiffies);
+		if (xchg(& breaker_state, BREAKER_OPEN) == BREAKER_CLOSED)
+		{
+			printk(KERN_NOTICE "[safe] Safe not responding, failing fast!\n");
+		}
+	}
+}
+
+static bool inflight_get(void)
+{
+	if (atomic_inc_return(& inflight) <= READ_ONCE(max_inflight))
+	{
+		return true;
+	}
+	atomic_dec(& inflight);
+
+	return false;
+}
+
+/*
+** Decide whether an upcall may be sent. Each admitted upcall must end with upcall_done.
+*/
+static bool upcall_admit(void)
+{
+	switch (READ_ONCE(breaker_state))
+	{
+		case BREAKER_OPEN:
+			if (time_before(jiffies, READ_ONCE(breaker_opened) + msecs_to_jiffies(breaker_cooldown_ms)))
+			{
+				return false;
+			}
+			if (cmpxchg(& breaker_state, BREAKER_OPEN, BREAKER_HALF_OPEN) != BREAKER_OPEN)
+			{
+				return false;
+			}
+			break;
+		case BREAKER_HALF_OPEN:
+			return false;
+	}
+	if (! wait_event_timeout(inflight_wait, inflight_get(), msecs_to_jiffies(upcall_timeout_ms)))
+	{
+		breaker_record(false);
+		return false;
+	}
+
+	return true;
+}
+
+static void upcall_done(bool ok)
+{
+	atomic_dec(& inflight);
+	wake_up(& inflight_wait);
+	breaker_record(ok);
+}
@@ -0,0 +1,140 @@
+#include <linux/xarray.h>
+#include <linux/moduleparam.h>
+
+/*
+** Ownership cache in front of the netlink upcall.
+** Both positive (inode -> owner uid) and negative (inode -> 0, not in safe) answers are
+** kept as xarray value entries, so lookups are lockless under RCU. The daemon pushes every
+** change of the safe table, and a generation counter keeps an upcall reply which raced
+** with such a change from being stored afterwards.
+** Only inodes of safe_dev, the device the safe table covers, ever reach the cache,
+** so an inode number alone identifies the file; the cache is flushed if safe_dev changes.
+** safe_dev is 0 until the daemon has told which device that is, and then every device
+** is checked.
+*/
+static DEFINE_XARRAY(owner_cache);
+static dev_t safe_dev = 0;
+static atomic_t cache_count = ATOMIC_INIT(0);
+static atomic_t cache_generation = ATOMIC_INIT(0);
+static unsigned long cache_cursor = 0;
+
+static unsigned int cache_size = 65536;
+module_param(cache_size, uint, 0644);
+MODULE_PARM_DESC(cache_size, "Maximum number of cached inode owners, 0 disables the cache");
+
+/*
+** Only the device the safe table covers can hold protected files; any other filesystem,
+** including pipes, sockets and pseudo filesystems, skips every check. While that device
+** is unknown, no filesystem can be ruled out.
+*/
+static bool on_safe_dev(struct inode * inode)
+{
+	dev_t dev = READ_ONCE(safe_dev);
+
+	return ! dev || inode -> i_sb -> s_dev == dev;
+}
+
+static bool cache_lookup(unsigned long inode, uid_t * owner)
+{
+	void * entry = xa_load(& owner_cache, inode);
+
+	if (! xa_is_value(entry))
+	{
+		return false;
+	}
+	* owner = xa_to_value(entry);
+
+	return true;
+}
+
+/*
+** Drop every cached answer, e.g. when the daemon (re)starts and the table may have changed.
+*/
+static void cache_flush(void)
+{
+	atomic_inc(& cache_generation);
+	xa_destroy(& owner_cache);
+	atomic_set(& cache_count, 0);
+}
+
+/*
+** Make room for one answer once the cache holds cache_size of them, evicting the first
+** one from cache_cursor on, round robin. Dropping an answer only costs a lookup later,
+** so unlike a change of the table, it leaves cache_generation alone. Under xa_lock.
+*/
+static void cache_evict(void)
+{
+	XA_STATE(xas, & owner_cache, cache_cursor);
+	void * entry;
+
+	if (atomic_read(& cache_count) < cache_size)
+	{
+		return;
+	}
+	entry = xas_find(& xas, ULONG_MAX);
+	if (! entry)
+	{
+		xas_set(& xas, 0);
+		entry = xas_find(& xas, ULONG_MAX);
+	}
+	if (entry)
+	{
+		xas_store(& xas, NULL);
+		atomic_dec(& cache_count);
+		cache_cursor = xas.xa_index + 1;
+	}
+}
+
+/*
+** Store an upcall reply, unless the table changed since the upcall was sent.
+** Note existing entries are never overwritten here, only by cache_update.
+*/
+static void cache_store(unsigned long inode, uid_t owner, int generation)
+{
+	void * old;
+
+	if (! cache_size)
+	{
+		return;
+	}
+	xa_lock(& owner_cache);
+	if (generation == atomic_read(& cache_generation))
+	{
+		cache_evict();
+		old = __xa_cmpxchg(& owner_cache, inode, NULL, xa_mk_value(owner), GFP_ATOMIC | __GFP_NOWARN);
+		if (! old)
+		{
+			atomic_inc(& cache_count);
+		}
+	}
+	xa_unlock(& owner_cache);
+}
+
+/*
+** Apply a change pushed by the daemon. Owner 0 means the inode has left the safe.
+** If the new answer cannot be stored, the stale one is dropped instead.
+*/
+static void cache_update(unsigned long inode, uid_t owner)
+{
+	void * old;
+
+	xa_lock(& owner_cache);
+	atomic_inc(& cache_generation);
+	if (! xa_load(& owner_cache, inode))
+	{
+		cache_evict();
+	}
+	old = __xa_store(& owner_cache, inode, xa_mk_value(owner), GFP_ATOMIC | __GFP_NOWARN);
+	if (xa_is_err(old))
+	{
+		if (__xa_erase(& owner_cache, inode))
+		{
+			atomic_dec(& cache_count);
+		}
+	}
+	else if (! old)
+	{
+		atomic_inc(& cache_count);
+	}
+	xa_unlock(& owner_cache);
+}
@@ -1,30 +1,296 @@
-#include <crypto/hash.h>
 #include <crypto/skcipher.h>
+#include <linux/crc32.h>
+#include <linux/list.h>
+#include <linux/wait.h>
+#include <linux/xarray.h>
+#include <linux/moduleparam.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/uio.h>
+#include <crypto/algapi.h>
+#include <asm/unaligned.h>
 
-static void generate_key(unsigned char * key)
+/*
+** Transforms of the cipher selected by probe.c are allocated once at module init:
+** a pool of skcipher transforms with their requests, two per possible cpu.
+** A pool slot remembers the key it was last set with, so a stream of transforms for
+** one owner only sets the key once.
+** Key and iv derivation use the crc32 library directly, which needs no transform.
+**
+** Data is transformed in bounce buffers of chunk_size bytes owned by each call, never
+** by a slot: a slot is only held while it transforms, so user memory which faults for
+** long, or a pipe which is not drained, cannot keep the pool from others.
+** Since CTR blocks are independent, I/O of at least parallel_threshold bytes is cut
+** into a batch of up to BATCH_MAX chunks, transformed concurrently on the unbound
+** workqueue by as many free slots, while the caller's slot transforms the rest.
+** Slots are shared fairly between uids, see account.c.
+*/
+#define CHUNK_MIN PAGE_SIZE
+#define CHUNK_MAX (256 * 1024)
+#define BATCH_MAX 16
+
+struct chunk_batch;
+
+struct cipher_slot
+{
+	struct list_head list;
+	struct crypto_skcipher * skcipher;
+	struct skcipher_request * req;
+	unsigned char key[32];
+	bool keyed;
+	/*
+	** Who holds the slot, and the bytes it transformed for them so far.
+	*/
+	struct crypto_account * account;
+	u64 charged;
+	/*
+	** The chunk the slot is loaded with, in a bounce buffer of the caller.
+	*/
+	const unsigned char * chunk_key;
+	const unsigned char * chunk_iv_base;
+	char * bounce;
+	loff_t offset;
+	size_t len;
+	struct chunk_batch * batch;
+	struct work_struct work;
+};
+
+/*
+** Chunks of one call: size bounce buffers, the first count of them loaded with the
+** chunks at offsets, and the slots transforming them.
+*/
+struct chunk_batch
+{
+	char * bounces[BATCH_MAX];
+	loff_t offsets[BATCH_MAX];
+	size_t lens[BATCH_MAX];
+	unsigned int size;
+	unsigned int count;
+	struct cipher_slot * slots[BATCH_MAX];
+	atomic_t pending;
+	struct completion done;
+};
+
+static unsigned int chunk_size = 16384;
+module_param(chunk_size, uint, 0444);
+MODULE_PARM_DESC(chunk_size, "Bytes transformed at a time through a bounce buffer, rounded to 16");
+
+static unsigned int parallel_threshold = 262144;
+module_param(parallel_threshold, uint, 0644);
+MODULE_PARM_DESC(parallel_threshold, "I/O of at least this many bytes is transformed on several cpus, 0 disables it");
+
+static struct cipher_slot * slots;
+static unsigned int slot_count;
+static LIST_HEAD(free_slots);
+static DEFINE_SPINLOCK(slot_lock);
+static DECLARE_WAIT_QUEUE_HEAD(slot_wait);
+
+/*
+** Callers waiting for a slot, which slot_release hands a slot to directly.
+*/
+struct slot_waiter
+{
+	struct list_head list;
+	struct crypto_account * account;
+	struct cipher_slot * slot;
+};
+
+static LIST_HEAD(slot_waiters);
+static u64 sched_vtime = 0;
+
+/*
+** Take a free slot for account, unless others are waiting. Under slot_lock.
+*/
+static struct cipher_slot * slot_take(struct crypto_account * account)
+{
+	struct cipher_slot * slot;
+
+	if (list_empty(& free_slots) || ! list_empty(& slot_waiters))
+	{
+		return NULL;
+	}
+	slot = list_first_entry(& free_slots, struct cipher_slot, list);
+	list_del(& slot -> list);
+	slot -> account = account;
+
+	return slot;
+}
+
+static struct cipher_slot * slot_get(struct crypto_account * account)
+{
+	struct cipher_slot * slot;
+
+	spin_lock(& slot_lock);
+	slot = slot_take(account);
+	spin_unlock(& slot_lock);
+
+	return slot;
+}
+
+/*
+** Take a slot for the euid of current, waiting for one in fair order if none is free.
+** Return NULL if current is killed while waiting.
+*/
+static struct cipher_slot * slot_acquire(void)
+{
+	struct slot_waiter waiter = { .account = account_get(current_euid().val) };
+	struct cipher_slot * slot;
+
+	spin_lock(& slot_lock);
+	slot = slot_take(waiter.account);
+	if (! slot)
+	{
+		waiter.account -> vtime = max(waiter.account -> vtime, sched_vtime);
+		list_add_tail(& waiter.list, & slot_waiters);
+	}
+	spin_unlock(& slot_lock);
+	if (! slot)
+	{
+		atomic64_inc(& waiter.account -> waits);
+		if (wait_event_killable(slot_wait, (slot = smp_load_acquire(& waiter.slot))))
+		{
+			/*
+			** A slot handed over meanwhile is kept; the caller is done with it soon anyway.
+			*/
+			spin_lock(& slot_lock);
+			slot = waiter.slot;
+			if (! slot)
+			{
+				list_del(& waiter.list);
+			}
+			spin_unlock(& slot_lock);
+		}
+	}
+
+	return slot;
+}
+
+/*
+** Charge the work done with slot, and hand it to the waiter of least virtual time, if any.
+*/
+static void slot_release(struct cipher_slot * slot)
 {
-	struct shash_desc sdesc;
-	uid_t uid = current_euid().val;
+	struct crypto_account * account = slot -> account;
+	struct slot_waiter * waiter, * next = NULL;
+
+	atomic64_add(slot -> charged, & account -> bytes);
+	spin_lock(& slot_lock);
+	account -> vtime += div_u64(slot -> charged, READ_ONCE(account -> weight));
+	slot -> charged = 0;
+	list_for_each_entry(waiter, & slot_waiters, list)
+	{
+		if (! next || waiter -> account -> vtime < next -> account -> vtime)
+		{
+			next = waiter;
+		}
+	}
+	if (next)
+	{
+		list_del(& next -> list);
+		sched_vtime = next -> account -> vtime;
+		slot -> account = next -> account;
+		smp_store_release(& next -> slot, slot);
+	}
+	else
+	{
+		list_add(& slot -> list, & free_slots);
+	}
+	spin_unlock(& slot_lock);
+	if (next)
+	{
+		wake_up(& slot_wait);
+	}
+}
+
+/*
+** Same value as a digest of the crc32 shash, whose default seed is 0.
+*/
+static void crc(const void * data, size_t len, unsigned char * out)
+{
+	put_unaligned_le32(crc32_le(0, data, len), out);
+}
+
+/*
+** Derived keys are kept per uid until the module is unloaded, since a key only depends
+** on its uid. Entries are never replaced or freed before unload, so a key read under RCU stays valid.
+*/
+struct key_entry
+{
+	unsigned char key[32];
+};
+
+#define KEY_CACHE_MAX 4096
+
+static DEFINE_XARRAY(key_cache);
+static atomic_t key_count = ATOMIC_INIT(0);
+
+static void generate_key(uid_t uid, unsigned char * key)
+{
+	struct key_entry * entry;
 	short i;
 
-	sdesc.tfm = crypto_alloc_shash("crc32-pclmul", 0, 0);
-	crypto_shash_digest(& sdesc, (char *)& uid, sizeof(uid_t), key + 28);
+	rcu_read_lock();
+	entry = xa_load(& key_cache, uid);
+	if (entry)
+	{
+		memcpy(key, entry -> key, 32);
+		rcu_read_unlock();
+		return;
+	}
+	rcu_read_unlock();
+
+	crc(& uid, sizeof(uid_t), key + 28);
 	for (i = 28; i > 0; i -= 4)
 	{
-		crypto_shash_digest(& sdesc, key + i, 32 - i, key + i - 4);
+		crc(key + i, 32 - i, key + i - 4);
+	}
+
+	if (atomic_inc_return(& key_count) > KEY_CACHE_MAX)
+	{
+		atomic_dec(& key_count);
+		return;
+	}
+	entry = kmalloc(sizeof(struct key_entry), GFP_KERNEL);
+	if (entry)
+	{
+		memcpy(entry -> key, key, 32);
+		if (! xa_cmpxchg(& key_cache, uid, NULL, entry, GFP_KERNEL))
+		{
+			return;
+		}
+		kzfree(entry);
 	}
-	crypto_free_shash(sdesc.tfm);
+	atomic_dec(& key_count);
 }
 
-static void generate_iv(char * iv, unsigned long inode, loff_t offset)
+static void key_cache_free(void)
+{
+	struct key_entry * entry;
+	unsigned long uid;
+
+	xa_for_each(& key_cache, uid, entry)
+	{
+		kzfree(entry);
+	}
+	xa_destroy(& key_cache);
+	atomic_set(& key_count, 0);
+}
+
+/*
+** The first half of an iv only depends on the inode, so callers derive it once per
+** open file; the second half is the big endian block offset.
+*/
+static void generate_iv_base(unsigned long inode, unsigned char * base)
+{
+	crc(& inode, sizeof(unsigned long), base + 4);
+	crc(base + 4, 4, base);
+}
+
+static inline void generate_iv(char * iv, const unsigned char * base, loff_t offset)
 {
-	struct shash_desc sdesc;
 	short i;
 
-	sdesc.tfm = crypto_alloc_shash("crc32-pclmul", 0, 0);
-	crypto_shash_digest(& sdesc, (char *)& inode, sizeof(unsigned long), iv + 4);
-	crypto_shash_digest(& sdesc, iv + 4, 4, iv);
-	crypto_free_shash(sdesc.tfm);
+	memcpy(iv, base, 8);
 	for (i = 0; i < sizeof(loff_t); ++i)
 	{
 		iv[15 - i] = ((char *)& offset)[i];
@@ -33,31 +299,493 @@ static void generate_iv(char * iv, unsigned long inode, loff_t offset)
 
 /*
 ** For the purpose of read/write random access, we choose AES CTR mode to transform plain/cipher.
-** The key is generated from owner uid, the iv is generated from file inode and read/write position.
+** The key is generated from owner uid by the caller, the iv from the iv base of the file
+** inode, also generated by the caller, and read/write position.
+** The chunk a slot is loaded with is transformed in its bounce buffer, where the chunk
+** starts at offset % 16, so the counter stays block aligned.
 */
-static void transform(char * buf, unsigned long inode, loff_t offset, size_t count)
+static void transform_chunk(struct cipher_slot * slot)
 {
-	struct crypto_skcipher * skcipher = NULL;
-	struct skcipher_request * req = NULL;
-	unsigned char key[32] = { 0 };
+	DECLARE_CRYPTO_WAIT(wait);
 	char ivdata[16] = { 0 };
-	char prefix[15] = { 0 };
-	short pre_len = offset & 0xf;
+	short pre_len = slot -> offset & 0xf;
 	struct scatterlist sg;
 
-	skcipher = crypto_alloc_skcipher("ctr-aes-aesni", 0, 0);
-	req = skcipher_request_alloc(skcipher, GFP_KERNEL);
-	generate_key(key);
-	crypto_skcipher_setkey(skcipher, key, 32);
-	generate_iv(ivdata, inode, offset >> 4);
-	buf -= pre_len;
-	sg_init_one(& sg, buf, count + pre_len);
-	skcipher_request_set_crypt(req, & sg, & sg, count + pre_len, ivdata);
-	memcpy(prefix, buf, pre_len);
-	crypto_skcipher_encrypt(req);
-	memcpy(buf, prefix, pre_len);
-	buf += pre_len;
-
-	crypto_free_skcipher(skcipher);
-	skcipher_request_free(req);
+	if (! slot -> keyed || memcmp(slot -> key, slot -> chunk_key, 32))
+	{
+		crypto_skcipher_setkey(slot -> skcipher, slot -> chunk_key, 32);
+		memcpy(slot -> key, slot -> chunk_key, 32);
+		slot -> keyed = true;
+	}
+	generate_iv(ivdata, slot -> chunk_iv_base, slot -> offset >> 4);
+	sg_init_one(& sg, slot -> bounce, pre_len + slot -> len);
+	skcipher_request_set_callback(slot -> req, CRYPTO_TFM_REQ_MAY_BACKLOG | CRYPTO_TFM_REQ_MAY_SLEEP,
+		crypto_req_done, & wait);
+	skcipher_request_set_crypt(slot -> req, & sg, & sg, pre_len + slot -> len, ivdata);
+	crypto_wait_req(crypto_skcipher_encrypt(slot -> req), & wait);
+	slot -> charged += slot -> len;
+}
+
+static void chunk_work(struct work_struct * work)
+{
+	struct cipher_slot * slot = container_of(work, struct cipher_slot, work);
+
+	transform_chunk(slot);
+	if (atomic_dec_and_test(& slot -> batch -> pending))
+	{
+		complete(& slot -> batch -> done);
+	}
+}
+
+static char * chunk_data(struct chunk_batch * batch, unsigned int i)
+{
+	return batch -> bounces[i] + (batch -> offsets[i] & 0xf);
+}
+
+/*
+** Allocate the bounce buffers of batch for count bytes: one, or when they are transformed
+** in parallel, as many as they fill up to BATCH_MAX, as far as memory readily allows.
+** Return 0, or -ENOMEM; batch_exit frees them either way.
+*/
+static int batch_init(struct chunk_batch * batch, size_t count)
+{
+	unsigned int size = 1;
+
+	if (parallel_threshold && count >= parallel_threshold)
+	{
+		size = min_t(size_t, BATCH_MAX, DIV_ROUND_UP(count, chunk_size - 16));
+	}
+	for (batch -> size = batch -> count = 0; batch -> size < size; ++ batch -> size)
+	{
+		batch -> bounces[batch -> size] = kmalloc(chunk_size,
+			batch -> size ? GFP_KERNEL | __GFP_NORETRY | __GFP_NOWARN : GFP_KERNEL);
+		if (! batch -> bounces[batch -> size])
+		{
+			break;
+		}
+	}
+
+	return batch -> size ? 0 : -ENOMEM;
+}
+
+static void batch_exit(struct chunk_batch * batch)
+{
+	unsigned int i;
+
+	for (i = 0; i < batch -> size; ++ i)
+	{
+		kzfree(batch -> bounces[i]);
+	}
+}
+
+/*
+** Lay consecutive chunks of the count bytes at offset out over the bounce buffers of
+** batch; return the number of bytes they cover.
+*/
+static size_t batch_load(struct chunk_batch * batch, loff_t offset, size_t count)
+{
+	size_t done = 0;
+
+	for (batch -> count = 0; batch -> count < batch -> size && done < count; ++ batch -> count)
+	{
+		batch -> offsets[batch -> count] = offset + done;
+		batch -> lens[batch -> count] = min_t(size_t, count - done, chunk_size - ((offset + done) & 0xf));
+		done += batch -> lens[batch -> count];
+	}
+
+	return done;
+}
+
+static void slot_load(struct cipher_slot * slot, struct chunk_batch * batch, unsigned int i)
+{
+	slot -> bounce = batch -> bounces[i];
+	slot -> offset = batch -> offsets[i];
+	slot -> len = batch -> lens[i];
+}
+
+/*
+** Transform the chunks loaded in batch with as many slots as are free, up to one per
+** chunk; the first slot takes the chunks left over. Every slot is released on return.
+** Return 0, or -EINTR if killed while waiting for a slot.
+*/
+static int batch_transform(struct chunk_batch * batch, const unsigned char * key, const unsigned char * iv_base)
+{
+	struct cipher_slot * slot;
+	unsigned int slots = 0, i;
+
+	do
+	{
+		/*
+		** Only the first slot is waited for, so batches cannot deadlock each other.
+		*/
+		slot = slots ? slot_get(batch -> slots[0] -> account) : slot_acquire();
+		if (! slot)
+		{
+			break;
+		}
+		slot -> chunk_key = key;
+		slot -> chunk_iv_base = iv_base;
+		slot -> batch = batch;
+		slot_load(slot, batch, slots);
+		batch -> slots[slots ++] = slot;
+	}
+	while (slots < batch -> count);
+	if (! slots)
+	{
+		return -EINTR;
+	}
+
+	atomic_set(& batch -> pending, slots - 1);
+	init_completion(& batch -> done);
+	for (i = 1; i < slots; ++ i)
+	{
+		queue_work(system_unbound_wq, & batch -> slots[i] -> work);
+	}
+	slot = batch -> slots[0];
+	transform_chunk(slot);
+	for (i = slots; i < batch -> count; ++ i)
+	{
+		slot_load(slot, batch, i);
+		transform_chunk(slot);
+	}
+	if (slots > 1)
+	{
+		wait_for_completion(& batch -> done);
+	}
+	for (i = 0; i < slots; ++ i)
+	{
+		slot_release(batch -> slots[i]);
+	}
+
+	return 0;
+}
+
+/*
+** Transform the count bytes just read into buf at offset, batch by batch.
+*/
+static int transform_to_user(char __user * buf, const unsigned char * key, const unsigned char * iv_base,
+	loff_t offset, size_t count)
+{
+	struct chunk_batch batch;
+	size_t done, len;
+	unsigned int i;
+	int err = batch_init(& batch, count);
+
+	for (done = 0; done < count && ! err; done += len)
+	{
+		len = batch_load(& batch, offset + done, count - done);
+		for (i = 0; i < batch.count && ! err; ++ i)
+		{
+			if (copy_from_user(chunk_data(& batch, i), buf + (batch.offsets[i] - offset), batch.lens[i]))
+			{
+				err = -EFAULT;
+			}
+		}
+		if (! err)
+		{
+			err = batch_transform(& batch, key, iv_base);
+		}
+		for (i = 0; i < batch.count && ! err; ++ i)
+		{
+			if (copy_to_user(buf + (batch.offsets[i] - offset), chunk_data(& batch, i), batch.lens[i]))
+			{
+				err = -EFAULT;
+			}
+		}
+		cond_resched();
+	}
+	batch_exit(& batch);
+
+	return err;
+}
+
+/*
+** Write count bytes of buf to file at * pos, transformed batch by batch, leaving buf as is.
+** Return the number of bytes written, or an error if none was.
+*/
+static ssize_t transform_from_user(struct file * file, const char __user * buf, const unsigned char * key,
+	const unsigned char * iv_base, size_t count, loff_t * pos)
+{
+	struct chunk_batch batch;
+	size_t written = 0;
+	ssize_t ret = 0;
+	loff_t offset;
+	unsigned int i;
+	bool stop = false;
+	int err = batch_init(& batch, count);
+
+	while (written < count && ! stop && ! err)
+	{
+		offset = * pos;
+		batch_load(& batch, offset, count - written);
+		for (i = 0; i < batch.count && ! err; ++ i)
+		{
+			if (copy_from_user(chunk_data(& batch, i), buf + written + (batch.offsets[i] - offset), batch.lens[i]))
+			{
+				err = -EFAULT;
+			}
+		}
+		if (! err)
+		{
+			err = batch_transform(& batch, key, iv_base);
+		}
+		for (i = 0; i < batch.count && ! stop && ! err; ++ i)
+		{
+			ret = kernel_write(file, chunk_data(& batch, i), batch.lens[i], pos);
+			if (ret > 0)
+			{
+				written += ret;
+			}
+			stop = ret <= 0 || (size_t)ret < batch.lens[i];
+		}
+		cond_resched();
+	}
+	batch_exit(& batch);
+
+	return written ? written : (err ? err : ret);
+}
+
+/*
+** Transform the count bytes just read into the segments of iter at offset; each segment
+** continues the keystream where the previous one stopped.
+*/
+static int transform_iov_to_user(const struct iov_iter * iter, const unsigned char * key,
+	const unsigned char * iv_base, loff_t offset, size_t count)
+{
+	unsigned long i;
+	size_t len;
+	int err = 0;
+
+	for (i = 0; i < iter -> nr_segs && count && ! err; ++ i)
+	{
+		len = min(count, iter -> iov[i].iov_len);
+		err = transform_to_user(iter -> iov[i].iov_base, key, iv_base, offset, len);
+		offset += len;
+		count -= len;
+	}
+
+	return err;
+}
+
+/*
+** Write the segments of iter to file at * pos, as transform_from_user does.
+*/
+static ssize_t transform_iov_from_user(struct file * file, const struct iov_iter * iter, const unsigned char * key,
+	const unsigned char * iv_base, loff_t * pos)
+{
+	size_t written = 0, left = iter -> count, len;
+	ssize_t ret = 0;
+	unsigned long i;
+
+	for (i = 0; i < iter -> nr_segs && left; ++ i)
+	{
+		len = min(left, iter -> iov[i].iov_len);
+		ret = transform_from_user(file, iter -> iov[i].iov_base, key, iv_base, len, pos);
+		if (ret > 0)
+		{
+			written += ret;
+			left -= ret;
+		}
+		if (ret <= 0 || (size_t)ret < len)
+		{
+			break;
+		}
+	}
+
+	return written ? written : ret;
+}
+
+/*
+** Transform len bytes of the buffer data in place, the bytes at offset starting at
+** offset % 16 of it, with a slot held for the transform only.
+** Return 0, or -EINTR if killed while waiting for a slot.
+*/
+static int transform_buffer(const unsigned char * key, const unsigned char * iv_base, loff_t offset,
+	char * data, size_t len)
+{
+	struct cipher_slot * slot = slot_acquire();
+
+	if (! slot)
+	{
+		return -EINTR;
+	}
+	slot -> chunk_key = key;
+	slot -> chunk_iv_base = iv_base;
+	slot -> bounce = data;
+	slot -> offset = offset;
+	slot -> len = len;
+	transform_chunk(slot);
+	slot_release(slot);
+
+	return 0;
+}
+
+/*
+** Copy count bytes from in at * in_pos to out at * out_pos, chunk by chunk, decrypting
+** with in_key if in is protected and encrypting with out_key if out is, so the data never
+** leaves the kernel. Since ivs are bound to the inode, ciphertext is never valid in another
+** file as is; a copy between two protected files is re-keyed in the buffer.
+** The data goes through a buffer of the call, and a slot is only held to transform it,
+** never across the read or the write, which may block for as long as a pipe or socket
+** is not drained.
+** Return the number of bytes copied, or an error if none was; * in_pos only accounts
+** for bytes which were written.
+*/
+static ssize_t transform_copy(struct file * in, loff_t * in_pos, const unsigned char * in_key,
+	const unsigned char * in_iv_base, struct file * out, loff_t * out_pos, const unsigned char * out_key,
+	const unsigned char * out_iv_base, size_t count)
+{
+	char * buf;
+	size_t copied = 0, len;
+	ssize_t ret = 0, got;
+	loff_t offset;
+	int err;
+
+	buf = kmalloc(chunk_size, GFP_KERNEL);
+	if (! buf)
+	{
+		return -ENOMEM;
+	}
+	while (copied < count)
+	{
+		/*
+		** Leave room for the data to start at either file's offset % 16.
+		*/
+		len = min_t(size_t, count - copied, chunk_size - 16);
+		offset = * in_pos;
+		got = ret = kernel_read(in, buf + (offset & 0xf), len, in_pos);
+		if (ret <= 0)
+		{
+			break;
+		}
+		err = in_key ? transform_buffer(in_key, in_iv_base, offset, buf, got) : 0;
+		memmove(buf + (* out_pos & 0xf), buf + (offset & 0xf), got);
+		if (! err && out_key)
+		{
+			err = transform_buffer(out_key, out_iv_base, * out_pos, buf, got);
+		}
+		ret = err ? err : kernel_write(out, buf + (* out_pos & 0xf), got, out_pos);
+		* in_pos -= got - max_t(ssize_t, ret, 0);
+		if (ret <= 0)
+		{
+			break;
+		}
+		copied += ret;
+		if ((size_t)ret < len)
+		{
+			break;
+		}
+		cond_resched();
+	}
+	kzfree(buf);
+
+	return copied ? copied : ret;
+}
+
+/*
+** Fill stream with len bytes, at most chunk_size, of keystream from the block aligned
+** offset on, for callers to XOR small I/O with. stream must not be vmalloc'ed.
+** Return 0, or -EINTR if killed while waiting for a slot.
+*/
+static int generate_keystream(const unsigned char * key, const unsigned char * iv_base, loff_t offset,
+	unsigned char * stream, size_t len)
+{
+	memset(stream, 0, len);
+
+	return transform_buffer(key, iv_base, offset, (char *)stream, len);
+}
+
+/*
+** Transform count bytes of a fresh private file mapping of current at addr, which map
+** the file from offset on. The mapping need not be readable nor writable, so it is
+** accessed the way ptrace does, which also breaks each page away from the page cache.
+*/
+static int transform_mapping(unsigned long addr, const unsigned char * key, const unsigned char * iv_base,
+	loff_t offset, size_t count)
+{
+	char * buf;
+	size_t done, len;
+	int err = 0;
+
+	buf = kmalloc(chunk_size, GFP_KERNEL);
+	if (! buf)
+	{
+		return -ENOMEM;
+	}
+	for (done = 0; done < count && ! err; done += len)
+	{
+		len = min_t(size_t, count - done, chunk_size - ((offset + done) & 0xf));
+		if (access_process_vm(current, addr + done, buf + ((offset + done) & 0xf), len, FOLL_FORCE) != (int)len)
+		{
+			err = -EFAULT;
+			break;
+		}
+		err = transform_buffer(key, iv_base, offset + done, buf, len);
+		if (! err && access_process_vm(current, addr + done, buf + ((offset + done) & 0xf), len,
+			FOLL_FORCE | FOLL_WRITE) != (int)len)
+		{
+			err = -EFAULT;
+		}
+		cond_resched();
+	}
+	kzfree(buf);
+
+	return err;
+}
+
+static void cipher_exit(void)
+{
+	unsigned int i;
+
+	for (i = 0; slots && i < slot_count; ++ i)
+	{
+		skcipher_request_free(slots[i].req);
+		crypto_free_skcipher(slots[i].skcipher);
+		memzero_explicit(slots[i].key, sizeof(slots[i].key));
+	}
+	kfree(slots);
+	slots = NULL;
+	key_cache_free();
+	account_exit();
+}
+
+static int __init cipher_init(void)
+{
+	unsigned int i;
+	int err = cipher_select();
+
+	if (err)
+	{
+		return err;
+	}
+	chunk_size = clamp_t(unsigned int, chunk_size, CHUNK_MIN, CHUNK_MAX) & ~0xf;
+	slot_count = 2 * num_possible_cpus();
+	slots = kcalloc(slot_count, sizeof(struct cipher_slot), GFP_KERNEL);
+	if (! slots)
+	{
+		cipher_exit();
+		return -ENOMEM;
+	}
+	for (i = 0; i < slot_count; ++ i)
+	{
+		slots[i].skcipher = crypto_alloc_skcipher(cipher, 0, 0);
+		if (IS_ERR(slots[i].skcipher))
+		{
+			slot_count = i;
+			cipher_exit();
+			return -ENOENT;
+		}
+		slots[i].req = skcipher_request_alloc(slots[i].skcipher, GFP_KERNEL);
+		if (! slots[i].req)
+		{
+			crypto_free_skcipher(slots[i].skcipher);
+			slot_count = i;
+			cipher_exit();
+			return -ENOMEM;
+		}
+		INIT_WORK(& slots[i].work, chunk_work);
+		list_add(& slots[i].list, & free_slots);
+	}
+
+	return 0;
 }
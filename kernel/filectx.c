@@ -0,0 +1,353 @@
+#include <linux/rhashtable.h>
+#include <linux/refcount.h>
+#include <linux/mutex.h>
+
+/*
+** Per open file context: the privilege decided for an open file and euid, along with
+** the inode number, key and iv base the transform needs, so reads and writes on an open
+** file skip the owner lookup and the key and iv derivation.
+** Only files in safe get a context: everything else is decided without the table.
+** A context is only valid for the inode (number and generation) and euid it was decided
+** for, and until the safe table changes (which bumps cache_generation), so a stale entry,
+** or one whose struct file was freed and reused, is simply decided again. Contexts are
+** dropped on close, and once the table holds file_ctx_size entries, an arbitrary one is
+** evicted for each new one, for files closed without close(2).
+** Hooks work on a copy of the context (struct file_ctx); the table holds file_entry.
+**
+** An entry also caches the last KEYSTREAM_LEN bytes of keystream its file needed, so
+** small sequential reads and writes, e.g. appends to a log, XOR against it instead of
+** setting up a transform each; a new window is only generated once I/O leaves it.
+** The window never leaves the entry: it is used and regenerated under the entry's
+** mutex, which a hook holds a reference for, and data goes through KEYSTREAM_BOUNCE
+** bytes of stack at a time.
+*/
+#define KEYSTREAM_LEN 512
+#define KEYSTREAM_BOUNCE 128
+
+struct file_ctx
+{
+	struct file * file;
+	struct inode * inode;
+	uid_t uid;
+	int generation;
+	unsigned long ino;
+	u32 i_generation;
+	unsigned char privilege;
+	unsigned char key[32];
+	unsigned char iv_base[8];
+};
+
+struct file_entry
+{
+	struct rhash_head node;
+	struct file_ctx ctx;
+	refcount_t ref;
+	struct mutex lock;
+	loff_t stream_offset;
+	unsigned int stream_len;
+	unsigned char stream[KEYSTREAM_LEN];
+	struct rcu_head rcu;
+};
+
+static const struct rhashtable_params file_ctx_params =
+{
+	.key_len = sizeof(struct file *),
+	.key_offset = offsetof(struct file_entry, ctx.file),
+	.head_offset = offsetof(struct file_entry, node),
+	.automatic_shrinking = true,
+};
+
+static struct rhashtable file_ctxs;
+static atomic_t file_ctx_count = ATOMIC_INIT(0);
+
+static unsigned int file_ctx_size = 65536;
+module_param(file_ctx_size, uint, 0644);
+MODULE_PARM_DESC(file_ctx_size, "Maximum number of open file contexts, 0 disables them");
+
+/*
+** Wipe the key of a context, before it goes out of scope.
+*/
+static void file_ctx_wipe(struct file_ctx * ctx)
+{
+	memzero_explicit(ctx -> key, sizeof(ctx -> key));
+}
+
+static void file_entry_free(struct file_entry * entry)
+{
+	file_ctx_wipe(& entry -> ctx);
+	memzero_explicit(entry -> stream, sizeof(entry -> stream));
+	kfree(entry);
+}
+
+static void file_entry_free_rcu(struct rcu_head * head)
+{
+	file_entry_free(container_of(head, struct file_entry, rcu));
+}
+
+static void file_entry_put(struct file_entry * entry)
+{
+	if (refcount_dec_and_test(& entry -> ref))
+	{
+		call_rcu(& entry -> rcu, file_entry_free_rcu);
+	}
+}
+
+static void file_ctx_remove(struct file_entry * entry)
+{
+	if (! rhashtable_remove_fast(& file_ctxs, & entry -> node, file_ctx_params))
+	{
+		atomic_dec(& file_ctx_count);
+		file_entry_put(entry);
+	}
+}
+
+/*
+** Copy the context of file into out, and return true if it is still valid.
+*/
+static bool file_ctx_lookup(struct file * file, uid_t uid, struct file_ctx * out)
+{
+	struct file_entry * entry;
+	bool valid = false;
+
+	if (! atomic_read(& file_ctx_count))
+	{
+		return false;
+	}
+	rcu_read_lock();
+	entry = rhashtable_lookup(& file_ctxs, & file, file_ctx_params);
+	if (entry && entry -> ctx.inode == file_inode(file) && entry -> ctx.ino == file_inode(file) -> i_ino
+		&& entry -> ctx.i_generation == file_inode(file) -> i_generation && entry -> ctx.uid == uid
+		&& entry -> ctx.generation == atomic_read(& cache_generation))
+	{
+		memcpy(out, & entry -> ctx, sizeof(struct file_ctx));
+		valid = true;
+	}
+	rcu_read_unlock();
+
+	return valid;
+}
+
+/*
+** Make room for one context, evicting the first one a walk of the table finds.
+*/
+static void file_ctx_evict(void)
+{
+	struct rhashtable_iter iter;
+	struct file_entry * entry;
+
+	rhashtable_walk_enter(& file_ctxs, & iter);
+	rhashtable_walk_start(& iter);
+	while ((entry = rhashtable_walk_next(& iter)))
+	{
+		if (! IS_ERR(entry))
+		{
+			file_ctx_remove(entry);
+			break;
+		}
+		if (PTR_ERR(entry) != -EAGAIN)
+		{
+			break;
+		}
+	}
+	rhashtable_walk_stop(& iter);
+	rhashtable_walk_exit(& iter);
+}
+
+/*
+** Remember a freshly decided context, replacing any stale one of the same file.
+*/
+static void file_ctx_store(const struct file_ctx * decided)
+{
+	struct file_entry * entry, * old;
+
+	if (! file_ctx_size)
+	{
+		return;
+	}
+	if (atomic_read(& file_ctx_count) >= file_ctx_size)
+	{
+		file_ctx_evict();
+	}
+	entry = kzalloc(sizeof(struct file_entry), GFP_KERNEL);
+	if (! entry)
+	{
+		return;
+	}
+	memcpy(& entry -> ctx, decided, sizeof(struct file_ctx));
+	refcount_set(& entry -> ref, 1);
+	mutex_init(& entry -> lock);
+	rcu_read_lock();
+	old = rhashtable_lookup(& file_ctxs, & entry -> ctx.file, file_ctx_params);
+	if (old && ! rhashtable_replace_fast(& file_ctxs, & old -> node, & entry -> node, file_ctx_params))
+	{
+		file_entry_put(old);
+		entry = NULL;
+	}
+	else if (! old && ! rhashtable_lookup_insert_fast(& file_ctxs, & entry -> node, file_ctx_params))
+	{
+		atomic_inc(& file_ctx_count);
+		entry = NULL;
+	}
+	rcu_read_unlock();
+	if (entry)
+	{
+		file_entry_free(entry);
+	}
+}
+
+static void file_ctx_drop(struct file * file)
+{
+	struct file_entry * entry;
+
+	if (! atomic_read(& file_ctx_count))
+	{
+		return;
+	}
+	rcu_read_lock();
+	entry = rhashtable_lookup(& file_ctxs, & file, file_ctx_params);
+	if (entry)
+	{
+		file_ctx_remove(entry);
+	}
+	rcu_read_unlock();
+}
+
+static void file_entry_release(struct file_entry * entry)
+{
+	mutex_unlock(& entry -> lock);
+	file_entry_put(entry);
+}
+
+/*
+** Take the entry of ctx with its window locked and covering the count bytes at offset,
+** generating a fresh window if needed. Return NULL if they cannot fit a window, or the
+** entry is gone; otherwise release it with file_entry_release.
+*/
+static struct file_entry * file_entry_window(const struct file_ctx * ctx, loff_t offset, size_t count)
+{
+	struct file_entry * entry;
+
+	if (! count || (offset & 0xf) + count > KEYSTREAM_LEN)
+	{
+		return NULL;
+	}
+	rcu_read_lock();
+	entry = rhashtable_lookup(& file_ctxs, & ctx -> file, file_ctx_params);
+	if (entry && (entry -> ctx.inode != ctx -> inode || entry -> ctx.uid != ctx -> uid
+		|| entry -> ctx.generation != ctx -> generation || ! refcount_inc_not_zero(& entry -> ref)))
+	{
+		entry = NULL;
+	}
+	rcu_read_unlock();
+	if (! entry)
+	{
+		return NULL;
+	}
+	if (mutex_lock_killable(& entry -> lock))
+	{
+		file_entry_put(entry);
+		return NULL;
+	}
+	if (offset < entry -> stream_offset || offset + count > entry -> stream_offset + entry -> stream_len)
+	{
+		entry -> stream_offset = offset & ~0xf;
+		entry -> stream_len = 0;
+		if (generate_keystream(entry -> ctx.key, entry -> ctx.iv_base, entry -> stream_offset, entry -> stream,
+			KEYSTREAM_LEN))
+		{
+			file_entry_release(entry);
+			return NULL;
+		}
+		entry -> stream_len = KEYSTREAM_LEN;
+	}
+
+	return entry;
+}
+
+/*
+** Transform the count bytes just read into buf, from offset of the file of ctx, with its
+** window. Return false if the window cannot serve them, else true with * err set.
+*/
+static bool keystream_to_user(const struct file_ctx * ctx, char __user * buf, loff_t offset, size_t count, int * err)
+{
+	unsigned char data[KEYSTREAM_BOUNCE];
+	struct file_entry * entry;
+	const unsigned char * stream;
+	size_t done, len;
+
+	entry = file_entry_window(ctx, offset, count);
+	if (! entry)
+	{
+		return false;
+	}
+	stream = entry -> stream + (offset - entry -> stream_offset);
+	* err = 0;
+	for (done = 0; done < count && ! * err; done += len)
+	{
+		len = min_t(size_t, count - done, KEYSTREAM_BOUNCE);
+		if (copy_from_user(data, buf + done, len))
+		{
+			* err = -EFAULT;
+			break;
+		}
+		crypto_xor(data, stream + done, len);
+		if (copy_to_user(buf + done, data, len))
+		{
+			* err = -EFAULT;
+		}
+	}
+	file_entry_release(entry);
+	memzero_explicit(data, sizeof(data));
+
+	return true;
+}
+
+/*
+** Write the count bytes of buf to file at * pos, transformed with the window of ctx.
+** Return false if the window cannot serve them, else true with * ret set.
+** The write is done in one piece, so only writes fitting the bounce are served.
+*/
+static bool keystream_from_user(struct file * file, const struct file_ctx * ctx, const char __user * buf,
+	size_t count, loff_t * pos, ssize_t * ret)
+{
+	unsigned char data[KEYSTREAM_BOUNCE];
+	struct file_entry * entry;
+
+	if (count > KEYSTREAM_BOUNCE)
+	{
+		return false;
+	}
+	entry = file_entry_window(ctx, * pos, count);
+	if (! entry)
+	{
+		return false;
+	}
+	if (copy_from_user(data, buf, count))
+	{
+		file_entry_release(entry);
+		* ret = -EFAULT;
+		return true;
+	}
+	crypto_xor(data, entry -> stream + (* pos - entry -> stream_offset), count);
+	file_entry_release(entry);
+	* ret = kernel_write(file, data, count, pos);
+	memzero_explicit(data, count);
+
+	return true;
+}
+
+static void file_ctx_free(void * ptr, void * arg)
+{
+	file_entry_free(ptr);
+}
+
+static int __init file_ctx_init(void)
+{
+	return rhashtable_init(& file_ctxs, & file_ctx_params);
+}
+
+static void __exit file_ctx_exit(void)
+{
+	rcu_barrier();
+	rhashtable_free_and_destroy(& file_ctxs, file_ctx_free, NULL);
+}
@@ -4,8 +4,22 @@
 #include <linux/unistd.h>
 #include <linux/file.h>
 #include <linux/dirent.h>
+#include <linux/mm.h>
+#include <linux/mman.h>
+#include <linux/uio.h>
+#include <linux/cred.h>
+#include <linux/capability.h>
+#include <linux/uaccess.h>
+#include <linux/namei.h>
+#include "cache.c"
+#include "marker.c"
+#include "breaker.c"
 #include "netlink.c"
+#include "ring.c"
+#include "probe.c"
+#include "account.c"
 #include "crypto.c"
+#include "filectx.c"
 
 MODULE_LICENSE("GPL");
 
@@ -20,6 +34,18 @@ old_syscall_t old_unlink = NULL;
 old_syscall_t old_unlinkat = NULL;
 old_syscall_t old_getdents64 = NULL;
 old_syscall_t old_openat = NULL;
+old_syscall_t old_close = NULL;
+old_syscall_t old_mmap = NULL;
+old_syscall_t old_pread64 = NULL;
+old_syscall_t old_pwrite64 = NULL;
+old_syscall_t old_readv = NULL;
+old_syscall_t old_writev = NULL;
+old_syscall_t old_preadv = NULL;
+old_syscall_t old_pwritev = NULL;
+old_syscall_t old_preadv2 = NULL;
+old_syscall_t old_pwritev2 = NULL;
+old_syscall_t old_sendfile = NULL;
+old_syscall_t old_copy_file_range = NULL;
 
 sys_call_ptr_t * sys_call_table = NULL;
 pte_t * pte = NULL;
@@ -27,21 +53,24 @@ unsigned int level = 0;
 
 /*
 ** The following two functions get inode number from fd or from filename.
-** Note we intensionally exclude character device file and block device file from
-** further privilege check, so the safe won't degrade system performance.
+** Note we intensionally exclude character device file and block device file, and any
+** file outside the device the safe covers, from further privilege check, so the safe
+** won't degrade system performance; for those 0 is returned.
+** Both read the protection marker on the way, while they hold the dentry.
 */
 static unsigned long get_ino_from_fd(unsigned int fd)
 {
 	struct fd f = fdget(fd);
-	umode_t mode = 0;
+	struct inode * inode;
 	unsigned long ino = 0;
 
-	if (! IS_ERR(f.file))
+	if (f.file)
 	{
-		mode = f.file -> f_inode -> i_mode;
-		if (! S_ISCHR(mode) && ! S_ISBLK(mode))
+		inode = file_inode(f.file);
+		if (on_safe_dev(inode) && ! S_ISCHR(inode -> i_mode) && ! S_ISBLK(inode -> i_mode))
 		{
-			ino = f.file -> f_inode -> i_ino;
+			ino = inode -> i_ino;
+			marker_prime(f.file -> f_path.dentry);
 		}
 		fdput(f);
 	}
@@ -51,23 +80,52 @@ static unsigned long get_ino_from_fd(unsigned int fd)
 
 static unsigned long get_ino_from_name(int dfd, const char * filename)
 {
-	struct kstat stat;
-	umode_t mode = 0;
+	struct path path;
+	struct inode * inode;
 	unsigned long ino = 0;
-	int error = vfs_statx(dfd, filename, AT_NO_AUTOMOUNT, & stat, STATX_BASIC_STATS);
+	int error = user_path_at(dfd, filename, LOOKUP_FOLLOW, & path);
 
 	if (! error)
 	{
-		mode = stat.mode;
-		if (! S_ISCHR(mode) && ! S_ISBLK(mode))
+		inode = d_inode(path.dentry);
+		if (on_safe_dev(inode) && ! S_ISCHR(inode -> i_mode) && ! S_ISBLK(inode -> i_mode))
 		{
-			ino = stat.ino;
+			ino = inode -> i_ino;
+			marker_prime(path.dentry);
 		}
+		path_put(& path);
 	}
 
 	return ino;
 }
 
+/*
+** Raw access for backup agents: a task in group backup_gid holding CAP_DAC_READ_SEARCH
+** opens, lists and transfers protected files as root does, that is as they are stored,
+** in ciphertext, so backup and restore cost no crypto. Renaming, unlinking and executing
+** protected files are still checked against its euid.
+** Note the iv is bound to the inode, so raw data only reads back on the same inode.
+*/
+static int backup_gid = -1;
+module_param(backup_gid, int, 0644);
+MODULE_PARM_DESC(backup_gid, "Group whose members with CAP_DAC_READ_SEARCH access protected files raw, -1 for none");
+
+/*
+** The uid file access is checked for: 0 for a backup agent, else current euid.
+*/
+static uid_t access_uid(void)
+{
+	int gid = READ_ONCE(backup_gid);
+
+	if (gid >= 0 && in_egroup_p(make_kgid(& init_user_ns, gid))
+		&& ns_capable_noaudit(& init_user_ns, CAP_DAC_READ_SEARCH))
+	{
+		return 0;
+	}
+
+	return current_euid().val;
+}
+
 /*
 ** Check privilege for hooked read, write, execve, getdents64 syscall.
 ** Privilege 2 indicates file is not in safe, or the request is from root,
@@ -76,29 +134,30 @@ static unsigned long get_ino_from_name(int dfd, const char * filename)
 ** in which case original syscall along with patch (excrypt, decrypt...) will be executed;
 ** Privilege 0 indicates file is in safe, and the request is not from owner,
 ** in which case syscall will be refused to execute.
+** A file whose owner cannot be told (OWNER_UNKNOWN) gets privilege 0 as well, so a failed
+** lookup refuses access instead of passing protected data through untransformed.
 ** Note the first 10 reserved inodes are excluded from privilege check.
 */
-static unsigned char check_privilege(unsigned long ino, uid_t uid)
+static unsigned char owner_privilege(uid_t owner, uid_t uid)
 {
-	uid_t owner = 0;
-	unsigned char privilege = 2;
-
-	if (ino > 10 && uid)
+	if (! owner)
 	{
-		owner = get_owner(ino);
-	}
-	if (owner)
-	{
-		privilege = (owner == uid) ? 1 : 0;
+		return 2;
 	}
 
-	return privilege;
+	return (owner == uid) ? 1 : 0;
+}
+
+static unsigned char check_privilege(unsigned long ino, uid_t uid)
+{
+	return owner_privilege((ino > 10 && uid) ? get_owner(ino) : 0, uid);
 }
 
 /*
 ** Check protection for hooked unlink, unlinkat syscall.
 ** Privilege 1 indicates file is not in safe, in which case original syscall will be executed;
 ** Privilege 0 indicates file is in safe, in which case syscall will be refused to execute.
+** A file whose owner cannot be told is refused too, except to root.
 ** Note the first 10 reserved inodes are excluded from protection check.
 */
 static unsigned char check_protection(unsigned long ino)
@@ -110,98 +169,499 @@ static unsigned char check_protection(unsigned long ino)
 		owner = get_owner(ino);
 	}
 
-	return (owner == 0);
+	return (owner == 0) || (owner == OWNER_UNKNOWN && ! current_euid().val);
 }
 
-static loff_t get_pos_from_fd(unsigned int fd, unsigned char op)
+/*
+** Decide the privilege of current euid on an open file, as check_privilege does,
+** and fill out its context, including the key when the file will be transformed.
+** Files which cannot be in safe, and root, are decided right away; the decision on
+** a file in safe is kept with the open file, so later reads and writes reuse it, unless
+** it was a refusal for want of an owner, which the next access decides again.
+*/
+static unsigned char file_privilege(struct file * file, uid_t uid, struct file_ctx * out)
 {
-	loff_t pos = 0;
-	struct fd f = fdget(fd);
+	struct inode * inode = file_inode(file);
+	uid_t owner;
 
-	if (f.file)
+	out -> privilege = 2;
+	if (! uid || inode -> i_ino <= 10 || ! on_safe_dev(inode) || S_ISCHR(inode -> i_mode) || S_ISBLK(inode -> i_mode))
 	{
-		if (op && (f.file -> f_flags & O_APPEND))
-		{
-			struct kstat stat;
-			vfs_fstat(fd, & stat);
-			pos = stat.size;
-		}
-		else
-		{
-			pos = f.file -> f_pos;
-		}
-		fdput(f);
+		return out -> privilege;
+	}
+	if (file_ctx_lookup(file, uid, out))
+	{
+		return out -> privilege;
+	}
+	memset(out, 0, sizeof(struct file_ctx));
+	out -> file = file;
+	out -> inode = inode;
+	out -> uid = uid;
+	out -> generation = atomic_read(& cache_generation);
+	out -> ino = inode -> i_ino;
+	out -> i_generation = inode -> i_generation;
+	marker_prime(file -> f_path.dentry);
+	owner = get_owner(out -> ino);
+	out -> privilege = owner_privilege(owner, uid);
+	if (out -> privilege == 1)
+	{
+		generate_key(uid, out -> key);
+		generate_iv_base(out -> ino, out -> iv_base);
+	}
+	if (out -> privilege != 2 && owner != OWNER_UNKNOWN)
+	{
+		file_ctx_store(out);
 	}
 
-	return pos;
+	return out -> privilege;
+}
+
+static loff_t get_pos(struct file * file, unsigned char op)
+{
+	if (op && (file -> f_flags & O_APPEND))
+	{
+		return i_size_read(file_inode(file));
+	}
+
+	return file -> f_pos;
 }
 
 /*
 ** The following functions are hooked syscalls, which check file privilege or
 ** protection for specific user, and execute corresponding operation.
+** Each of them first takes the original syscall directly if the safe is empty.
 **
 ** Note Linux follows System V AMD64 ABI calling convention, so:
-** rdi				|rsi				|rdx				|r10
-** first parameter	|second parameter	|third parameter	|fourth parameter
+** rdi				|rsi				|rdx				|r10				|r8				|r9
+** first parameter	|second parameter	|third parameter	|fourth parameter	|fifth parameter	|sixth parameter
 */
 /*
-** ssize_t read(unsigned int fd, char * buf, size_t count);
+** The segments a hooked read or write transfers: the vlen ones at vec, or buf alone if
+** vec is NULL, using fast as storage if it fits. * iov is to be freed afterwards.
 */
-asmlinkage ssize_t hooked_read(struct pt_regs * regs)
+static ssize_t import_segments(int type, char __user * buf, size_t count, const struct iovec __user * vec,
+	unsigned long vlen, struct iovec * fast, struct iovec ** iov, struct iov_iter * iter)
 {
-	unsigned long ino;
-	uid_t uid;
-	ssize_t ret = -1;
+	* iov = fast;
+	if (vec)
+	{
+		return import_iovec(type, vec, vlen, UIO_FASTIOV, iov, iter);
+	}
+	* iov = NULL;
+
+	return import_single_range(type, buf, count, fast, iter);
+}
+
+/*
+** Common part of the hooked reads: run the original syscall on the file at fd, then
+** decrypt what it read into the segments of buf or vec (see import_segments), from
+** * ppos on, or from the file position if ppos is NULL.
+*/
+static ssize_t read_common(struct pt_regs * regs, old_syscall_t old, char __user * buf, size_t count,
+	const struct iovec __user * vec, unsigned long vlen, loff_t * ppos)
+{
+	struct fd f;
+	struct file_ctx ctx;
+	struct iovec fast[UIO_FASTIOV], * iov;
+	struct iov_iter iter;
+	unsigned char privilege;
+	ssize_t ret = -1, err;
 	loff_t pos = 0;
+	int rerr;
 
-	ino = get_ino_from_fd(regs -> di);
-	uid = current_euid().val;
-	switch (check_privilege(ino, uid))
+	f = fdget(regs -> di);
+	if (! f.file)
+	{
+		return old(regs);
+	}
+	privilege = file_privilege(f.file, access_uid(), & ctx);
+	pos = ppos ? * ppos : get_pos(f.file, 0);
+	fdput(f);
+	switch (privilege)
 	{
 		case 2:
-			ret = old_read(regs);
+			ret = old(regs);
 			break;
 		case 1:
-			pos = get_pos_from_fd(regs -> di, 0);
-			ret = old_read(regs);
-			transform((char *)regs -> si, ino, pos, ret);
+			ret = old(regs);
+			if (ret > 0 && ! vec && keystream_to_user(& ctx, buf, pos, ret, & rerr))
+			{
+				if (rerr)
+				{
+					ret = rerr;
+				}
+			}
+			else if (ret > 0)
+			{
+				err = import_segments(READ, buf, count, vec, vlen, fast, & iov, & iter);
+				if (err < 0)
+				{
+					ret = err;
+				}
+				else
+				{
+					err = transform_iov_to_user(& iter, ctx.key, ctx.iv_base, pos, ret);
+					if (err)
+					{
+						ret = err;
+					}
+				}
+				kfree(iov);
+			}
 			break;
 		case 0:
 			;
 	}
+	file_ctx_wipe(& ctx);
 
 	return ret;
 }
 
+#define RWF_TRANSFORMED (RWF_HIPRI | RWF_DSYNC | RWF_SYNC | RWF_APPEND)
+
 /*
-** ssize_t write(unsigned int fd, const char * buf, size_t count);
+** Common part of the hooked writes: write the segments of buf or vec to the file at fd,
+** transformed if needed, at * ppos, or at the file position if ppos is NULL, as the
+** original syscall would with flags.
+** The ciphertext is written from the bounce buffers, so the caller's buffers are never
+** modified; the file position is advanced as write(2) would.
 */
-asmlinkage ssize_t hooked_write(struct pt_regs * regs)
+static ssize_t write_common(struct pt_regs * regs, old_syscall_t old, char __user * buf, size_t count,
+	const struct iovec __user * vec, unsigned long vlen, loff_t * ppos, rwf_t flags)
 {
-	unsigned long ino;
-	uid_t uid;
-	ssize_t ret = -1;
-	loff_t pos = 0;
+	struct fd f;
+	struct file_ctx ctx;
+	struct iovec fast[UIO_FASTIOV], * iov = NULL;
+	struct iov_iter iter;
+	unsigned char privilege;
+	ssize_t ret = -1, err;
+	loff_t pos = 0, start;
 
-	ino = get_ino_from_fd(regs -> di);
-	uid = current_euid().val;
-	switch (check_privilege(ino, uid))
+	f = fdget(regs -> di);
+	if (! f.file)
+	{
+		return old(regs);
+	}
+	privilege = file_privilege(f.file, access_uid(), & ctx);
+	switch (privilege)
 	{
 		case 2:
-			ret = old_write(regs);
+			ret = old(regs);
 			break;
 		case 1:
-			pos = get_pos_from_fd(regs -> di, 1);
-			transform((char *)regs -> si, ino, pos, regs -> dx);
-			ret = old_write(regs);
+			if (ppos && (* ppos < 0 || ! (f.file -> f_mode & FMODE_PWRITE)))
+			{
+				ret = (* ppos < 0) ? -EINVAL : -ESPIPE;
+				break;
+			}
+			if (flags & ~RWF_TRANSFORMED)
+			{
+				ret = -EOPNOTSUPP;
+				break;
+			}
+			pos = get_pos(f.file, 1);
+			if (flags & RWF_APPEND)
+			{
+				pos = i_size_read(file_inode(f.file));
+			}
+			else if (ppos && ! (f.file -> f_flags & O_APPEND))
+			{
+				pos = * ppos;
+			}
+			start = pos;
+			if (vec || ! keystream_from_user(f.file, & ctx, buf, count, & pos, & ret))
+			{
+				ret = import_segments(WRITE, buf, count, vec, vlen, fast, & iov, & iter);
+				if (ret < 0)
+				{
+					break;
+				}
+				ret = transform_iov_from_user(f.file, & iter, ctx.key, ctx.iv_base, & pos);
+			}
+			if (ret > 0 && (flags & (RWF_DSYNC | RWF_SYNC)))
+			{
+				err = vfs_fsync_range(f.file, start, pos - 1, ! (flags & RWF_SYNC));
+				if (err)
+				{
+					ret = err;
+				}
+			}
+			if (ret >= 0 && ! ppos)
+			{
+				f.file -> f_pos = pos;
+			}
+			kfree(iov);
 			break;
 		case 0:
 			;
 	}
+	fdput(f);
+	file_ctx_wipe(& ctx);
+
+	return ret;
+}
+
+/*
+** ssize_t read(unsigned int fd, char * buf, size_t count);
+*/
+asmlinkage ssize_t hooked_read(struct pt_regs * regs)
+{
+	if (! static_branch_unlikely(& safe_active))
+	{
+		return old_read(regs);
+	}
+
+	return read_common(regs, old_read, (char __user *)regs -> si, regs -> dx, NULL, 0, NULL);
+}
+
+/*
+** ssize_t write(unsigned int fd, const char * buf, size_t count);
+*/
+asmlinkage ssize_t hooked_write(struct pt_regs * regs)
+{
+	if (! static_branch_unlikely(& safe_active))
+	{
+		return old_write(regs);
+	}
+
+	return write_common(regs, old_write, (char __user *)regs -> si, regs -> dx, NULL, 0, NULL, 0);
+}
+
+/*
+** ssize_t pread64(unsigned int fd, char * buf, size_t count, loff_t pos);
+*/
+asmlinkage ssize_t hooked_pread64(struct pt_regs * regs)
+{
+	loff_t pos = regs -> r10;
+
+	if (! static_branch_unlikely(& safe_active))
+	{
+		return old_pread64(regs);
+	}
+
+	return read_common(regs, old_pread64, (char __user *)regs -> si, regs -> dx, NULL, 0, & pos);
+}
+
+/*
+** ssize_t pwrite64(unsigned int fd, const char * buf, size_t count, loff_t pos);
+*/
+asmlinkage ssize_t hooked_pwrite64(struct pt_regs * regs)
+{
+	loff_t pos = regs -> r10;
+
+	if (! static_branch_unlikely(& safe_active))
+	{
+		return old_pwrite64(regs);
+	}
+
+	return write_common(regs, old_pwrite64, (char __user *)regs -> si, regs -> dx, NULL, 0, & pos, 0);
+}
+
+/*
+** ssize_t readv(unsigned long fd, const struct iovec * vec, unsigned long vlen);
+*/
+asmlinkage ssize_t hooked_readv(struct pt_regs * regs)
+{
+	if (! static_branch_unlikely(& safe_active))
+	{
+		return old_readv(regs);
+	}
+
+	return read_common(regs, old_readv, NULL, 0, (const struct iovec __user *)regs -> si, regs -> dx, NULL);
+}
+
+/*
+** ssize_t writev(unsigned long fd, const struct iovec * vec, unsigned long vlen);
+*/
+asmlinkage ssize_t hooked_writev(struct pt_regs * regs)
+{
+	if (! static_branch_unlikely(& safe_active))
+	{
+		return old_writev(regs);
+	}
+
+	return write_common(regs, old_writev, NULL, 0, (const struct iovec __user *)regs -> si, regs -> dx, NULL, 0);
+}
+
+/*
+** ssize_t preadv(unsigned long fd, const struct iovec * vec, unsigned long vlen,
+**		unsigned long pos_l, unsigned long pos_h);
+** On 64 bit, pos_l holds the whole position.
+*/
+asmlinkage ssize_t hooked_preadv(struct pt_regs * regs)
+{
+	loff_t pos = regs -> r10;
+
+	if (! static_branch_unlikely(& safe_active))
+	{
+		return old_preadv(regs);
+	}
+
+	return read_common(regs, old_preadv, NULL, 0, (const struct iovec __user *)regs -> si, regs -> dx, & pos);
+}
+
+/*
+** ssize_t pwritev(unsigned long fd, const struct iovec * vec, unsigned long vlen,
+**		unsigned long pos_l, unsigned long pos_h);
+*/
+asmlinkage ssize_t hooked_pwritev(struct pt_regs * regs)
+{
+	loff_t pos = regs -> r10;
+
+	if (! static_branch_unlikely(& safe_active))
+	{
+		return old_pwritev(regs);
+	}
+
+	return write_common(regs, old_pwritev, NULL, 0, (const struct iovec __user *)regs -> si, regs -> dx, & pos, 0);
+}
+
+/*
+** ssize_t preadv2(unsigned long fd, const struct iovec * vec, unsigned long vlen,
+**		unsigned long pos_l, unsigned long pos_h, rwf_t flags);
+** Position -1 means the file position, as for readv.
+*/
+asmlinkage ssize_t hooked_preadv2(struct pt_regs * regs)
+{
+	loff_t pos = regs -> r10;
+
+	if (! static_branch_unlikely(& safe_active))
+	{
+		return old_preadv2(regs);
+	}
+
+	return read_common(regs, old_preadv2, NULL, 0, (const struct iovec __user *)regs -> si, regs -> dx,
+		(pos == -1) ? NULL : & pos);
+}
+
+/*
+** ssize_t pwritev2(unsigned long fd, const struct iovec * vec, unsigned long vlen,
+**		unsigned long pos_l, unsigned long pos_h, rwf_t flags);
+*/
+asmlinkage ssize_t hooked_pwritev2(struct pt_regs * regs)
+{
+	loff_t pos = regs -> r10;
+
+	if (! static_branch_unlikely(& safe_active))
+	{
+		return old_pwritev2(regs);
+	}
+
+	return write_common(regs, old_pwritev2, NULL, 0, (const struct iovec __user *)regs -> si, regs -> dx,
+		(pos == -1) ? NULL : & pos, (__force rwf_t)regs -> r9);
+}
+
+/*
+** Store the position a hooked copy ended at, back where it was taken from.
+*/
+static int put_pos(struct file * file, loff_t __user * off, loff_t pos)
+{
+	if (off)
+	{
+		return put_user(pos, off);
+	}
+	file -> f_pos = pos;
+
+	return 0;
+}
+
+/*
+** Common part of the hooked copies: copy count bytes from the file at in_fd to the file at
+** out_fd, at the positions in_off and out_off point to, or at the file positions for NULL.
+** A copy from or to a protected file is done by transform_copy, in the kernel; any other
+** one by the original syscall.
+*/
+static ssize_t copy_common(struct pt_regs * regs, old_syscall_t old, unsigned int in_fd, loff_t __user * in_off,
+	unsigned int out_fd, loff_t __user * out_off, size_t count)
+{
+	struct fd in, out;
+	struct file_ctx in_ctx, out_ctx;
+	unsigned char in_privilege, out_privilege;
+	uid_t uid = access_uid();
+	ssize_t ret = -1;
+	loff_t in_pos, out_pos;
+
+	in = fdget(in_fd);
+	out = fdget(out_fd);
+	if (! in.file || ! out.file)
+	{
+		fdput(out);
+		fdput(in);
+		return old(regs);
+	}
+	in_privilege = file_privilege(in.file, uid, & in_ctx);
+	out_privilege = file_privilege(out.file, uid, & out_ctx);
+	if (in_privilege == 2 && out_privilege == 2)
+	{
+		ret = old(regs);
+	}
+	else if (in_privilege && out_privilege)
+	{
+		in_pos = in.file -> f_pos;
+		out_pos = out.file -> f_pos;
+		if ((in_off && get_user(in_pos, in_off)) || (out_off && get_user(out_pos, out_off)))
+		{
+			ret = -EFAULT;
+		}
+		else if (in_pos < 0 || out_pos < 0 || (out.file -> f_flags & O_APPEND))
+		{
+			ret = -EINVAL;
+		}
+		else if (file_inode(in.file) == file_inode(out.file)
+			&& in_pos < out_pos + (loff_t)count && out_pos < in_pos + (loff_t)count)
+		{
+			ret = -EINVAL;
+		}
+		else
+		{
+			ret = transform_copy(in.file, & in_pos, (in_privilege == 1) ? in_ctx.key : NULL, in_ctx.iv_base,
+				out.file, & out_pos, (out_privilege == 1) ? out_ctx.key : NULL, out_ctx.iv_base,
+				min_t(size_t, count, MAX_RW_COUNT));
+		}
+		if (ret >= 0 && put_pos(in.file, in_off, in_pos))
+		{
+			ret = -EFAULT;
+		}
+		if (ret >= 0 && put_pos(out.file, out_off, out_pos))
+		{
+			ret = -EFAULT;
+		}
+	}
+	fdput(out);
+	fdput(in);
+	file_ctx_wipe(& in_ctx);
+	file_ctx_wipe(& out_ctx);
 
 	return ret;
 }
 
+/*
+** ssize_t sendfile(int out_fd, int in_fd, loff_t * offset, size_t count);
+*/
+asmlinkage ssize_t hooked_sendfile(struct pt_regs * regs)
+{
+	if (! static_branch_unlikely(& safe_active))
+	{
+		return old_sendfile(regs);
+	}
+
+	return copy_common(regs, old_sendfile, regs -> si, (loff_t __user *)regs -> dx, regs -> di, NULL, regs -> r10);
+}
+
+/*
+** ssize_t copy_file_range(int fd_in, loff_t * off_in, int fd_out, loff_t * off_out, size_t len, unsigned int flags);
+*/
+asmlinkage ssize_t hooked_copy_file_range(struct pt_regs * regs)
+{
+	if (! static_branch_unlikely(& safe_active) || regs -> r9)
+	{
+		return old_copy_file_range(regs);
+	}
+
+	return copy_common(regs, old_copy_file_range, regs -> di, (loff_t __user *)regs -> si,
+		regs -> dx, (loff_t __user *)regs -> r10, regs -> r8);
+}
+
 /*
 ** ssize_t execve(const char * filename, const char * const argv[], const char * const envp[]);
 */
@@ -211,6 +671,11 @@ asmlinkage ssize_t hooked_execve(struct pt_regs * regs)
 	uid_t uid;
 	ssize_t ret = -1;
 
+	if (! static_branch_unlikely(& safe_active))
+	{
+		return old_execve(regs);
+	}
+
 	ino = get_ino_from_name(AT_FDCWD, (char *)regs -> di);
 	uid = current_euid().val;
 	switch (check_privilege(ino, uid))
@@ -235,6 +700,11 @@ asmlinkage ssize_t hooked_rename(struct pt_regs * regs)
 	uid_t uid;
 	ssize_t ret = -1;
 
+	if (! static_branch_unlikely(& safe_active))
+	{
+		return old_rename(regs);
+	}
+
 	oldino = get_ino_from_name(AT_FDCWD, (char *)regs -> di);
 	newino = get_ino_from_name(AT_FDCWD, (char *)regs -> si);
 	uid = current_euid().val;
@@ -254,6 +724,11 @@ asmlinkage ssize_t hooked_unlink(struct pt_regs * regs)
 	unsigned long ino;
 	ssize_t ret = -1;
 
+	if (! static_branch_unlikely(& safe_active))
+	{
+		return old_unlink(regs);
+	}
+
 	ino = get_ino_from_name(AT_FDCWD, (char *)regs -> di);
 	if (check_protection(ino))
 	{
@@ -271,6 +746,11 @@ asmlinkage ssize_t hooked_unlinkat(struct pt_regs * regs)
 	unsigned long ino;
 	ssize_t ret = -1;
 
+	if (! static_branch_unlikely(& safe_active))
+	{
+		return old_unlinkat(regs);
+	}
+
 	ino = get_ino_from_name(regs -> di, (char *)regs -> si);
 	if (check_protection(ino))
 	{
@@ -281,67 +761,241 @@ asmlinkage ssize_t hooked_unlinkat(struct pt_regs * regs)
 }
 
 /*
-** ssize_t getdents64(unsigned int fd, struct linux_dirent64 * dirent, unsigned int count);
+** Hide unprivileged files from a linux_dirent64 buffer of len bytes, and return its new length.
+** The buffer is copied in, the owners of all its entries are looked up together,
+** and the visible entries are packed to the front, so no empty record is left behind.
 */
-asmlinkage ssize_t hooked_getdents64(struct pt_regs * regs)
+static ssize_t hide_dirents(char __user * buf, size_t len, uid_t uid)
 {
-	uid_t uid;
-	ssize_t ret = -1;
-	unsigned long bpos;
+	char * kbuf;
+	unsigned long * inodes = NULL;
+	uid_t * owners = NULL;
 	struct linux_dirent64 * d;
+	size_t bpos, kpos = 0;
+	unsigned int count = 0, i = 0;
+	unsigned short reclen;
+	ssize_t ret = -ENOMEM;
 
-	uid = current_euid().val;
-	ret = old_getdents64(regs);
-	/*
-	** Iterate over linux_dirent64 structs to hide unprivileged files.
-	*/
+	kbuf = kvmalloc(len, GFP_KERNEL);
+	if (! kbuf)
+	{
+		return ret;
+	}
+	if (copy_from_user(kbuf, buf, len))
+	{
+		ret = -EFAULT;
+		goto out;
+	}
 	/*
-	** There is a weird bug in this implentation, which I'll review later.
+	** Count whole records only, in case the buffer was changed under us; a record
+	** header is only read once it fits in the buffer.
 	*/
-	/* for (bpos = 0; bpos < ret; )
+	for (bpos = 0; bpos < len; bpos += reclen, ++ count)
 	{
-		if (! check_privilege(d -> d_ino, uid))
+		if (len - bpos < offsetof(struct linux_dirent64, d_name))
 		{
-			ret -= d -> d_reclen;
-			memcpy(d, (void *)d + d -> d_reclen, ret - bpos);
+			break;
 		}
-		else
+		reclen = ((struct linux_dirent64 *)(kbuf + bpos)) -> d_reclen;
+		if (reclen < offsetof(struct linux_dirent64, d_name) || reclen > len - bpos)
 		{
-			bpos += d -> d_reclen;
+			break;
 		}
-	} */
-	for (bpos = 0; bpos < ret; bpos += d -> d_reclen)
+	}
+	len = bpos;
+	inodes = kvmalloc_array(count, sizeof(unsigned long), GFP_KERNEL);
+	owners = kvmalloc_array(count, sizeof(uid_t), GFP_KERNEL);
+	if (! inodes || ! owners)
 	{
-		d = (struct linux_dirent64 *)(regs -> si + bpos);
-		if (! check_privilege(d -> d_ino, uid))
+		goto out;
+	}
+	for (bpos = 0; bpos < len; bpos += d -> d_reclen)
+	{
+		d = (struct linux_dirent64 *)(kbuf + bpos);
+		inodes[i ++] = d -> d_ino;
+	}
+	get_owners(inodes, count, owners);
+	for (bpos = 0, i = 0; bpos < len; bpos += reclen, ++ i)
+	{
+		d = (struct linux_dirent64 *)(kbuf + bpos);
+		reclen = d -> d_reclen;
+		if (owners[i] && owners[i] != uid)
+		{
+			continue;
+		}
+		if (kpos != bpos)
 		{
-			d -> d_ino = 0;
-			memset(d -> d_name, 0, d -> d_reclen - 20);
+			memmove(kbuf + kpos, d, reclen);
 		}
+		kpos += reclen;
+	}
+	ret = copy_to_user(buf, kbuf, kpos) ? -EFAULT : kpos;
+
+out:
+	kvfree(owners);
+	kvfree(inodes);
+	kvfree(kbuf);
+	return ret;
+}
+
+/*
+** ssize_t getdents64(unsigned int fd, struct linux_dirent64 * dirent, unsigned int count);
+** Only directories on the device the safe covers are filtered.
+** If every entry of a buffer is hidden, the next one is read, since 0 means end of directory.
+*/
+asmlinkage ssize_t hooked_getdents64(struct pt_regs * regs)
+{
+	uid_t uid;
+	ssize_t ret = -1;
+
+	if (! static_branch_unlikely(& safe_active))
+	{
+		return old_getdents64(regs);
 	}
 
+	uid = access_uid();
+	if (! uid || ! get_ino_from_fd(regs -> di))
+	{
+		return old_getdents64(regs);
+	}
+	do
+	{
+		ret = old_getdents64(regs);
+		if (ret <= 0)
+		{
+			break;
+		}
+		ret = hide_dirents((char __user *)regs -> si, ret, uid);
+	} while (! ret);
+
 	return ret;
 }
 
 /*
 ** ssize_t openat(int dfd, const char * filename, int flags, int mode);
+** The decision is attached to the opened file right away, for its reads and writes.
 */
 asmlinkage ssize_t hooked_openat(struct pt_regs * regs)
 {
 	unsigned long ino;
 	uid_t uid;
 	ssize_t ret = -1;
+	struct fd f;
+	struct file_ctx ctx;
+
+	if (! static_branch_unlikely(& safe_active))
+	{
+		return old_openat(regs);
+	}
 
 	ino = get_ino_from_name(regs -> di, (char *)regs -> si);
-	uid = current_euid().val;
+	uid = access_uid();
 	if (check_privilege(ino, uid))
 	{
 		ret = old_openat(regs);
+		if (ret >= 0 && ino)
+		{
+			f = fdget(ret);
+			if (f.file)
+			{
+				file_privilege(f.file, uid, & ctx);
+				file_ctx_wipe(& ctx);
+				fdput(f);
+			}
+		}
 	}
 
 	return ret;
 }
 
+/*
+** int close(unsigned int fd);
+** Drop the context of the file, which is decided again if it is still open elsewhere.
+*/
+asmlinkage ssize_t hooked_close(struct pt_regs * regs)
+{
+	struct fd f;
+
+	if (atomic_read(& file_ctx_count))
+	{
+		f = fdget(regs -> di);
+		if (f.file)
+		{
+			file_ctx_drop(f.file);
+			fdput(f);
+		}
+	}
+
+	return old_close(regs);
+}
+
+/*
+** void * mmap(void * addr, size_t length, int prot, int flags, int fd, off_t offset);
+** Mapped pages come from the page cache, which holds ciphertext, so a private mapping
+** of a protected file is decrypted in place right away, every page of it becoming a
+** private copy. A shared mapping, whose stores would reach the file as plaintext,
+** is refused, and so is a private one which would decrypt more than mmap_limit bytes,
+** as all of it would be held in memory.
+*/
+static unsigned long mmap_limit = 64UL << 20;
+module_param(mmap_limit, ulong, 0644);
+MODULE_PARM_DESC(mmap_limit, "Maximum bytes of a protected file a private mapping decrypts, larger ones get ENOMEM");
+
+asmlinkage ssize_t hooked_mmap(struct pt_regs * regs)
+{
+	struct fd f;
+	struct file_ctx ctx;
+	unsigned char privilege;
+	ssize_t ret = -1;
+	loff_t size;
+	int err;
+
+	if (! static_branch_unlikely(& safe_active) || (regs -> r10 & MAP_ANONYMOUS))
+	{
+		return old_mmap(regs);
+	}
+
+	f = fdget(regs -> r8);
+	if (! f.file)
+	{
+		return old_mmap(regs);
+	}
+	privilege = file_privilege(f.file, access_uid(), & ctx);
+	size = i_size_read(file_inode(f.file));
+	fdput(f);
+	switch (privilege)
+	{
+		case 2:
+			ret = old_mmap(regs);
+			break;
+		case 1:
+			if ((regs -> r10 & MAP_TYPE) != MAP_PRIVATE)
+			{
+				ret = -EACCES;
+				break;
+			}
+			if ((loff_t)regs -> r9 < size && min_t(loff_t, regs -> si, size - regs -> r9) > READ_ONCE(mmap_limit))
+			{
+				ret = -ENOMEM;
+				break;
+			}
+			ret = old_mmap(regs);
+			err = (! IS_ERR_VALUE(ret) && (loff_t)regs -> r9 < size) ? transform_mapping(ret, ctx.key, ctx.iv_base,
+				regs -> r9, min_t(loff_t, regs -> si, size - regs -> r9)) : 0;
+			if (err)
+			{
+				vm_munmap(ret, regs -> si);
+				ret = err;
+			}
+			break;
+		case 0:
+			;
+	}
+	file_ctx_wipe(& ctx);
+
+	return ret;
+}
+
 /*
 ** Get sys_call_table address.
 */
@@ -359,7 +1013,26 @@ static sys_call_ptr_t * get_sys_call_table(void)
 */
 static int __init hook_init(void)
 {
-	netlink_init();
+	int err = cipher_init();
+
+	if (err)
+	{
+		return err;
+	}
+	err = file_ctx_init();
+	if (err)
+	{
+		cipher_exit();
+		return err;
+	}
+	err = netlink_init();
+	if (err)
+	{
+		rhashtable_destroy(& file_ctxs);
+		cipher_exit();
+		return err;
+	}
+	ring_init();
 
 	sys_call_table = get_sys_call_table();
 	old_read = (old_syscall_t)sys_call_table[__NR_read];
@@ -370,6 +1043,18 @@ static int __init hook_init(void)
 	old_unlinkat = (old_syscall_t)sys_call_table[__NR_unlinkat];
 	old_getdents64 = (old_syscall_t)sys_call_table[__NR_getdents64];
 	old_openat = (old_syscall_t)sys_call_table[__NR_openat];
+	old_close = (old_syscall_t)sys_call_table[__NR_close];
+	old_mmap = (old_syscall_t)sys_call_table[__NR_mmap];
+	old_pread64 = (old_syscall_t)sys_call_table[__NR_pread64];
+	old_pwrite64 = (old_syscall_t)sys_call_table[__NR_pwrite64];
+	old_readv = (old_syscall_t)sys_call_table[__NR_readv];
+	old_writev = (old_syscall_t)sys_call_table[__NR_writev];
+	old_preadv = (old_syscall_t)sys_call_table[__NR_preadv];
+	old_pwritev = (old_syscall_t)sys_call_table[__NR_pwritev];
+	old_preadv2 = (old_syscall_t)sys_call_table[__NR_preadv2];
+	old_pwritev2 = (old_syscall_t)sys_call_table[__NR_pwritev2];
+	old_sendfile = (old_syscall_t)sys_call_table[__NR_sendfile];
+	old_copy_file_range = (old_syscall_t)sys_call_table[__NR_copy_file_range];
 	pte = lookup_address((unsigned long)sys_call_table, & level);
 	set_pte_atomic(pte, pte_mkwrite(* pte));
 	sys_call_table[__NR_read] = (sys_call_ptr_t)hooked_read;
@@ -380,6 +1065,18 @@ static int __init hook_init(void)
 	sys_call_table[__NR_unlinkat] = (sys_call_ptr_t)hooked_unlinkat;
 	sys_call_table[__NR_getdents64] = (sys_call_ptr_t)hooked_getdents64;
 	sys_call_table[__NR_openat] = (sys_call_ptr_t)hooked_openat;
+	sys_call_table[__NR_close] = (sys_call_ptr_t)hooked_close;
+	sys_call_table[__NR_mmap] = (sys_call_ptr_t)hooked_mmap;
+	sys_call_table[__NR_pread64] = (sys_call_ptr_t)hooked_pread64;
+	sys_call_table[__NR_pwrite64] = (sys_call_ptr_t)hooked_pwrite64;
+	sys_call_table[__NR_readv] = (sys_call_ptr_t)hooked_readv;
+	sys_call_table[__NR_writev] = (sys_call_ptr_t)hooked_writev;
+	sys_call_table[__NR_preadv] = (sys_call_ptr_t)hooked_preadv;
+	sys_call_table[__NR_pwritev] = (sys_call_ptr_t)hooked_pwritev;
+	sys_call_table[__NR_preadv2] = (sys_call_ptr_t)hooked_preadv2;
+	sys_call_table[__NR_pwritev2] = (sys_call_ptr_t)hooked_pwritev2;
+	sys_call_table[__NR_sendfile] = (sys_call_ptr_t)hooked_sendfile;
+	sys_call_table[__NR_copy_file_range] = (sys_call_ptr_t)hooked_copy_file_range;
 	set_pte_atomic(pte, pte_clear_flags(* pte, _PAGE_RW));
 
 	return 0;
@@ -399,9 +1096,24 @@ static void __exit hook_exit(void)
 	sys_call_table[__NR_unlinkat] = (sys_call_ptr_t)old_unlinkat;
 	sys_call_table[__NR_getdents64] = (sys_call_ptr_t)old_getdents64;
 	sys_call_table[__NR_openat] = (sys_call_ptr_t)old_openat;
+	sys_call_table[__NR_close] = (sys_call_ptr_t)old_close;
+	sys_call_table[__NR_mmap] = (sys_call_ptr_t)old_mmap;
+	sys_call_table[__NR_pread64] = (sys_call_ptr_t)old_pread64;
+	sys_call_table[__NR_pwrite64] = (sys_call_ptr_t)old_pwrite64;
+	sys_call_table[__NR_readv] = (sys_call_ptr_t)old_readv;
+	sys_call_table[__NR_writev] = (sys_call_ptr_t)old_writev;
+	sys_call_table[__NR_preadv] = (sys_call_ptr_t)old_preadv;
+	sys_call_table[__NR_pwritev] = (sys_call_ptr_t)old_pwritev;
+	sys_call_table[__NR_preadv2] = (sys_call_ptr_t)old_preadv2;
+	sys_call_table[__NR_pwritev2] = (sys_call_ptr_t)old_pwritev2;
+	sys_call_table[__NR_sendfile] = (sys_call_ptr_t)old_sendfile;
+	sys_call_table[__NR_copy_file_range] = (sys_call_ptr_t)old_copy_file_range;
 	set_pte_atomic(pte, pte_clear_flags(* pte, _PAGE_RW));
 
+	ring_exit();
+	file_ctx_exit();
 	netlink_exit();
+	cipher_exit();
 }
 
 module_init(hook_init);
@@ -0,0 +1,48 @@
+#include <linux/xattr.h>
+#include <linux/kdev_t.h>
+
+/*
+** Protection marker: the daemon stores the inode number and owner uid of every protected
+** file in the trusted.safe xattr, which only CAP_SYS_ADMIN can set or remove. The inode
+** number binds the marker to its file, so a copy carrying the xattr along is not trusted.
+** Whenever a hook holds a dentry whose inode is not cached yet, the marker is read
+** from it and its answer is kept in the ownership cache, so later checks are a cache hit.
+** A missing marker only means unprotected once every row is marked.
+*/
+#define SAFE_XATTR "trusted.safe"
+
+struct marker
+{
+	unsigned long ino;
+	uid_t uid;
+};
+
+static bool marker_authoritative = false;
+
+static void marker_prime(struct dentry * dentry)
+{
+	struct inode * inode = d_inode(dentry);
+	struct marker marker;
+	uid_t owner;
+	int generation;
+	ssize_t len;
+
+	if (! inode || inode -> i_ino <= 10 || ! on_safe_dev(inode))
+	{
+		return;
+	}
+	if (cache_lookup(inode -> i_ino, & owner))
+	{
+		return;
+	}
+	generation = atomic_read(& cache_generation);
+	len = __vfs_getxattr(dentry, inode, SAFE_XATTR, & marker, sizeof(struct marker));
+	if (len == sizeof(struct marker) && marker.ino == inode -> i_ino && marker.uid)
+	{
+		cache_store(inode -> i_ino, marker.uid, generation);
+	}
+	else if (len == -ENODATA && READ_ONCE(marker_authoritative))
+	{
+		cache_store(inode -> i_ino, 0, generation);
+	}
+}
@@ -1,88 +1,339 @@
 #include <net/netlink.h>
 #include <net/net_namespace.h>
 #include <asm/atomic.h>
-#include <linux/semaphore.h>
+#include <linux/completion.h>
+#include <linux/slab.h>
+#include <linux/jump_label.h>
 
 #define NETLINK_SAFE 30
 
+/*
+** Netlink message types
+** SAFE_MSG_READY	|daemon to kernel	|daemon ready signal
+** SAFE_MSG_OWNER	|both directions	|owner query with inodes, and its reply with uids
+** SAFE_MSG_UPDATE	|daemon to kernel	|a row of the safe table changed
+** SAFE_MSG_CENSUS	|daemon to kernel	|row counts of the safe table, and the device it covers
+*/
+#define SAFE_MSG_READY 0x10
+#define SAFE_MSG_OWNER 0x11
+#define SAFE_MSG_UPDATE 0x12
+#define SAFE_MSG_CENSUS 0x13
+
+struct update
+{
+	unsigned long ino;
+	uid_t uid;
+};
+
+struct census
+{
+	unsigned long count;
+	unsigned long unmarked;
+	unsigned long dev;
+};
+
 static struct sock * socket;
 static int pid = 0;
 static int ino_len = sizeof(unsigned long);
 static atomic_t sequence = ATOMIC_INIT(0);
 
-static struct queue
+/*
+** Enabled only while the safe holds any file. Until then every hook jumps
+** straight to the original syscall, so an empty safe costs a patched nop.
+** A ready daemon enables it until its census says otherwise, so a daemon which
+** cannot publish one leaves every check on.
+*/
+static DEFINE_STATIC_KEY_FALSE(safe_active);
+
+/*
+** Owner queries carry up to SAFE_BATCH_MAX inode numbers, answered by as many uids in order.
+*/
+#define SAFE_BATCH_MAX 1024
+
+/*
+** Owner of an inode whose lookup failed: the daemon is gone, timed out, or is not asked
+** while the breaker is open. It matches no euid, so such a file is refused, not exposed.
+*/
+#define OWNER_UNKNOWN ((uid_t)-1)
+
+/*
+** One in-flight upcall, indexed in the upcalls table by its netlink sequence number.
+*/
+struct upcall
+{
+	struct completion done;
+	unsigned int count;
+	unsigned int pending;
+	uid_t * uids;
+};
+
+static struct kmem_cache * upcall_cache;
+static DEFINE_XARRAY(upcalls);
+
+/*
+** Defined in ring.c, the shared memory transport tried before netlink.
+*/
+static int ring_submit(unsigned int seq, const unsigned long * inodes, unsigned int count);
+
+/*
+** Deliver one answer of upcall seq from the ring transport, and wake the waiter on the last one.
+*/
+static void answer_upcall(unsigned int seq, unsigned int index, uid_t uid)
 {
-	uid_t data[65536];
-	struct semaphore sem[65536];
-} rspbuf;
+	struct upcall * up;
 
-DEFINE_RATELIMIT_STATE(rs, 3 * HZ, 1);
+	xa_lock(& upcalls);
+	up = xa_load(& upcalls, seq);
+	if (up && index < up -> count && up -> pending)
+	{
+		up -> uids[index] = uid;
+		if (! -- up -> pending)
+		{
+			complete(& up -> done);
+		}
+	}
+	xa_unlock(& upcalls);
+}
 
 /*
-** Send inode number to user space daemon process via netlink, and wait for response (uid).
+** Send inode numbers to user space daemon process via netlink, and wait for response (uids).
 ** Note we maintain atomic sequence number to synchronize netlink with response request,
-** and use semaphore to synchronize buffer queue read operation with write operation.
-** The above plus a large enough buffer queue will avoid race conditions.
+** and register each request in the upcalls table under its full 32 bit sequence number,
+** skipping any number still in flight after a wrap, so a reply always finds its waiter.
+** Return 0 on success, or -1 if the daemon gave no answer in time or was not asked at all.
 */
-static uid_t get_owner(unsigned long inode)
+static int query_owners(const unsigned long * inodes, unsigned int count, uid_t * owners)
 {
 	struct sk_buff * skb;
 	struct nlmsghdr * nlh;
-	unsigned short seq;
+	struct upcall * up;
+	unsigned int seq;
+	int err, ret = -1;
 
 	/*
-	** If user space daemon process is not ready.
+	** If user space daemon process is not ready, or the breaker says it is failing.
 	*/
-	if (! pid)
+	if (! pid || ! upcall_admit())
 	{
-		return 0;
+		return -1;
 	}
-	skb = nlmsg_new(ino_len, GFP_ATOMIC);
-	if (! skb)
+	up = kmem_cache_alloc(upcall_cache, GFP_KERNEL);
+	if (! up)
+	{
+		goto done;
+	}
+	init_completion(& up -> done);
+	memset(owners, 0, count * sizeof(uid_t));
+	up -> count = count;
+	up -> pending = count;
+	up -> uids = owners;
+	do
+	{
+		seq = atomic_inc_return(& sequence);
+		err = xa_insert(& upcalls, seq, up, GFP_KERNEL);
+	} while (err == -EBUSY);
+	if (err)
 	{
-		return 0;
+		goto free;
+	}
+	if (ring_submit(seq, inodes, count))
+	{
+		skb = nlmsg_new(count * ino_len, GFP_KERNEL);
+		if (! skb)
+		{
+			goto erase;
+		}
+		nlh = nlmsg_put(skb, 0, seq, SAFE_MSG_OWNER, count * ino_len, 0);
+		memcpy(NLMSG_DATA(nlh), inodes, count * ino_len);
+		if (nlmsg_unicast(socket, skb, pid) < 0)
+		{
+			if (xchg(& pid, 0))
+			{
+				printk(KERN_NOTICE "[safe] Safe terminated!\n");
+			}
+			goto erase;
+		}
 	}
-	nlh = nlmsg_put(skb, 0, 0, NLMSG_DONE, ino_len, 0);
-	seq = atomic_inc_return(& sequence);
-	nlh -> nlmsg_seq = seq;
-	* (unsigned long *)NLMSG_DATA(nlh) = inode;
-	nlmsg_unicast(socket, skb, pid);
 	/*
-	** Wait for at most 3s. Tested on Linux with 250 HZ timer interrupt frequency.
+	** Wait for at most upcall_timeout_ms.
+	** Once the request is erased from the table, no reply can touch it any more.
 	*/
-	if (down_timeout(& rspbuf.sem[seq], 3 * HZ))
+	if (wait_for_completion_timeout(& up -> done, msecs_to_jiffies(upcall_timeout_ms)))
+	{
+		ret = 0;
+	}
+
+erase:
+	xa_erase(& upcalls, seq);
+free:
+	kmem_cache_free(upcall_cache, up);
+done:
+	upcall_done(! ret);
+	return ret;
+}
+
+/*
+** Resolve n cache misses with one upcall, and remember the answers; without an answer,
+** their owners are OWNER_UNKNOWN, which is never cached.
+*/
+static void resolve_misses(const unsigned long * misses, const unsigned int * index, uid_t * answers,
+	unsigned int n, uid_t * owners, int generation)
+{
+	unsigned int i;
+	bool answered = ! query_owners(misses, n, answers);
+
+	for (i = 0; i < n; ++ i)
 	{
-		if (__ratelimit(& rs))
+		owners[index[i]] = answered ? answers[i] : OWNER_UNKNOWN;
+		if (answered)
 		{
-			pid = 0;
-			printk(KERN_NOTICE "[safe] Safe terminated!\n");
+			cache_store(misses[i], answers[i], generation);
 		}
-		return 0;
 	}
+}
+
+/*
+** Get owner uids of inodes, 0 for those not in safe, OWNER_UNKNOWN for those which
+** could not be looked up.
+** The ownership cache answers first, and all misses go up to the daemon together,
+** SAFE_BATCH_MAX at a time. The first 10 reserved inodes are never in safe.
+*/
+static void get_owners(const unsigned long * inodes, unsigned int count, uid_t * owners)
+{
+	unsigned long * misses = NULL;
+	unsigned int * index = NULL;
+	uid_t * answers = NULL;
+	unsigned int i, n = 0;
+	unsigned int cap = min_t(unsigned int, count, SAFE_BATCH_MAX);
+	int generation = atomic_read(& cache_generation);
 
-	return rspbuf.data[seq];
+	memset(owners, 0, count * sizeof(uid_t));
+	for (i = 0; i < count; ++ i)
+	{
+		if (inodes[i] <= 10 || cache_lookup(inodes[i], owners + i))
+		{
+			continue;
+		}
+		if (! misses)
+		{
+			misses = kmalloc_array(cap, sizeof(unsigned long) + sizeof(unsigned int) + sizeof(uid_t), GFP_KERNEL);
+			if (! misses)
+			{
+				for (; i < count; ++ i)
+				{
+					if (inodes[i] > 10 && ! cache_lookup(inodes[i], owners + i))
+					{
+						owners[i] = OWNER_UNKNOWN;
+					}
+				}
+				return;
+			}
+			index = (unsigned int *)(misses + cap);
+			answers = (uid_t *)(index + cap);
+		}
+		misses[n] = inodes[i];
+		index[n ++] = i;
+		if (n == cap)
+		{
+			resolve_misses(misses, index, answers, n, owners, generation);
+			n = 0;
+		}
+	}
+	if (n)
+	{
+		resolve_misses(misses, index, answers, n, owners, generation);
+	}
+	kfree(misses);
 }
 
 /*
-** If daemon process is ready, this will receive owner uid;
+** Get owner uid of inode, 0 if it is not in safe, OWNER_UNKNOWN if that cannot be told.
+*/
+static uid_t get_owner(unsigned long inode)
+{
+	uid_t owner;
+
+	get_owners(& inode, 1, & owner);
+
+	return owner;
+}
+
+/*
+** If daemon process is ready, this will receive owner uid or table updates;
 ** Otherwise this will receive a ready signal.
+** Note only root may push updates or announce itself as the daemon.
 */
 static void nl_receive_callback(struct sk_buff * skb)
 {
 	struct nlmsghdr * nlh = (struct nlmsghdr *)skb -> data;
+	struct update * upd;
+	struct census * census;
+	struct upcall * up;
+	unsigned int count;
 
-	if (* (unsigned long *)NLMSG_DATA(nlh) >> 32 != 0xffffffff)
+	/*
+	** Drop malformed messages before looking at their payload.
+	*/
+	if (skb -> len < NLMSG_HDRLEN || nlh -> nlmsg_len < NLMSG_HDRLEN || nlh -> nlmsg_len > skb -> len)
 	{
-		rspbuf.data[nlh -> nlmsg_seq] = * (uid_t *)NLMSG_DATA(nlh);
-		up(& rspbuf.sem[nlh -> nlmsg_seq]);
+		return;
 	}
-	else
+	switch (nlh -> nlmsg_type)
 	{
-		if (NETLINK_CREDS(skb) -> pid == nlh -> nlmsg_pid && ! NETLINK_CREDS(skb) -> uid.val)
-		{
-			printk(KERN_NOTICE "[safe] Safe initiated!\n");
-			pid = nlh -> nlmsg_pid;
-		}
+		case SAFE_MSG_OWNER:
+			if (NETLINK_CB(skb).portid != pid)
+			{
+				break;
+			}
+			xa_lock(& upcalls);
+			up = xa_load(& upcalls, nlh -> nlmsg_seq);
+			if (up && up -> pending)
+			{
+				count = min_t(unsigned int, up -> count, (nlh -> nlmsg_len - NLMSG_HDRLEN) / sizeof(uid_t));
+				memcpy(up -> uids, NLMSG_DATA(nlh), count * sizeof(uid_t));
+				up -> pending = 0;
+				complete(& up -> done);
+			}
+			xa_unlock(& upcalls);
+			break;
+		case SAFE_MSG_UPDATE:
+			if (nlh -> nlmsg_len >= NLMSG_LENGTH(sizeof(struct update)) && ! NETLINK_CREDS(skb) -> uid.val)
+			{
+				upd = (struct update *)NLMSG_DATA(nlh);
+				cache_update(upd -> ino, upd -> uid);
+			}
+			break;
+		case SAFE_MSG_CENSUS:
+			if (nlh -> nlmsg_len >= NLMSG_LENGTH(sizeof(struct census)) && ! NETLINK_CREDS(skb) -> uid.val)
+			{
+				census = (struct census *)NLMSG_DATA(nlh);
+				if (new_decode_dev(census -> dev) != READ_ONCE(safe_dev))
+				{
+					WRITE_ONCE(safe_dev, new_decode_dev(census -> dev));
+					cache_flush();
+				}
+				WRITE_ONCE(marker_authoritative, ! census -> unmarked);
+				if (census -> count)
+				{
+					static_branch_enable(& safe_active);
+				}
+				else
+				{
+					static_branch_disable(& safe_active);
+				}
+			}
+			break;
+		case SAFE_MSG_READY:
+			if (NETLINK_CREDS(skb) -> pid == nlh -> nlmsg_pid && ! NETLINK_CREDS(skb) -> uid.val)
+			{
+				printk(KERN_NOTICE "[safe] Safe initiated!\n");
+				WRITE_ONCE(safe_dev, 0);
+				cache_flush();
+				static_branch_enable(& safe_active);
+				breaker_record(true);
+				pid = nlh -> nlmsg_pid;
+			}
+			break;
 	}
 }
 
@@ -92,15 +343,13 @@ static int __init netlink_init(void)
 	{
 		.input = nl_receive_callback,
 	};
-	int i;
 
-	socket = netlink_kernel_create(& init_net, NETLINK_SAFE, & cfg);
-	for (i = 0; i < 65536; ++ i)
+	upcall_cache = kmem_cache_create("safe_upcall", sizeof(struct upcall), 0, 0, NULL);
+	if (! upcall_cache)
 	{
-		rspbuf.data[i] = 0;
-		sema_init(& rspbuf.sem[i], 0);
+		return -ENOMEM;
 	}
-	ratelimit_set_flags(& rs, RATELIMIT_MSG_ON_RELEASE);
+	socket = netlink_kernel_create(& init_net, NETLINK_SAFE, & cfg);
 
 	return 0;
 }
@@ -111,4 +360,6 @@ static void __exit netlink_exit(void)
 	{
 		netlink_kernel_release(socket);
 	}
+	kmem_cache_destroy(upcall_cache);
+	cache_flush();
 }
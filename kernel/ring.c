@@ -0,0 +1,226 @@
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/vmalloc.h>
+#include <linux/capability.h>
+#include <linux/mutex.h>
+
+/*
+** Shared memory transport for owner queries.
+** The daemon opens /dev/safe and maps a submission ring of (seq, index, inode) entries
+** produced by hooked syscalls, and a completion ring of (seq, index, uid) entries it
+** produces itself. Kernel producers of the submission ring serialize on ring_lock, and
+** the daemon's workers all consume it, each claiming entries by moving the tail with
+** compare-and-swap; the completion ring has kernel space as its only consumer. The
+** device polls readable while submissions are pending, and any write to it drains the
+** completion ring.
+** Netlink remains the transport whenever the device is not open or the ring is full.
+*/
+#define RING_SIZE 4096
+
+struct ring_entry
+{
+	u32 seq;
+	u32 index;
+	u64 value;
+};
+
+struct ring
+{
+	u32 head __attribute__((aligned(64)));
+	u32 tail __attribute__((aligned(64)));
+	struct ring_entry entries[RING_SIZE] __attribute__((aligned(64)));
+};
+
+struct ring_area
+{
+	struct ring sq;
+	struct ring cq;
+};
+
+static bool ring_transport = true;
+module_param(ring_transport, bool, 0444);
+MODULE_PARM_DESC(ring_transport, "Offer the shared memory ring transport on /dev/safe");
+
+static struct ring_area * ring_area;
+static DEFINE_SPINLOCK(ring_lock);
+static DEFINE_MUTEX(complete_lock);
+static DECLARE_WAIT_QUEUE_HEAD(ring_wait);
+static atomic_t ring_open = ATOMIC_INIT(0);
+
+/*
+** Queue all count inodes of upcall seq, or none of them.
+** Return 0 on success, or -1 if the caller should fall back to netlink.
+*/
+static int ring_submit(unsigned int seq, const unsigned long * inodes, unsigned int count)
+{
+	struct ring * sq;
+	u32 head, tail;
+	unsigned int i;
+
+	spin_lock(& ring_lock);
+	if (! ring_area)
+	{
+		spin_unlock(& ring_lock);
+		return -1;
+	}
+	sq = & ring_area -> sq;
+	head = sq -> head;
+	tail = smp_load_acquire(& sq -> tail);
+	if (RING_SIZE - (head - tail) < count)
+	{
+		spin_unlock(& ring_lock);
+		return -1;
+	}
+	for (i = 0; i < count; ++ i)
+	{
+		sq -> entries[(head + i) & (RING_SIZE - 1)].seq = seq;
+		sq -> entries[(head + i) & (RING_SIZE - 1)].index = i;
+		sq -> entries[(head + i) & (RING_SIZE - 1)].value = inodes[i];
+	}
+	smp_store_release(& sq -> head, head + count);
+	/*
+	** The daemon may only be asleep if it had consumed everything before us.
+	*/
+	smp_mb();
+	if (READ_ONCE(sq -> tail) == head)
+	{
+		wake_up_interruptible(& ring_wait);
+	}
+	spin_unlock(& ring_lock);
+
+	return 0;
+}
+
+/*
+** Drain the completion ring. Entries are validated, since the daemon writes them.
+** Every worker of the daemon writes to the device, so drains serialize on complete_lock.
+*/
+static void ring_complete(void)
+{
+	struct ring * cq = & ring_area -> cq;
+	struct ring_entry * e;
+	u32 head, tail;
+
+	mutex_lock(& complete_lock);
+	head = smp_load_acquire(& cq -> head);
+	tail = cq -> tail;
+	if (head - tail > RING_SIZE)
+	{
+		tail = head - RING_SIZE;
+	}
+	for (; tail != head; ++ tail)
+	{
+		e = & cq -> entries[tail & (RING_SIZE - 1)];
+		answer_upcall(READ_ONCE(e -> seq), READ_ONCE(e -> index), READ_ONCE(e -> value));
+	}
+	smp_store_release(& cq -> tail, tail);
+	mutex_unlock(& complete_lock);
+}
+
+static int ring_dev_open(struct inode * inode, struct file * file)
+{
+	struct ring_area * area;
+
+	if (! capable(CAP_SYS_ADMIN))
+	{
+		return -EPERM;
+	}
+	if (atomic_cmpxchg(& ring_open, 0, 1))
+	{
+		return -EBUSY;
+	}
+	area = vmalloc_user(sizeof(struct ring_area));
+	if (! area)
+	{
+		atomic_set(& ring_open, 0);
+		return -ENOMEM;
+	}
+	spin_lock(& ring_lock);
+	ring_area = area;
+	spin_unlock(& ring_lock);
+
+	return 0;
+}
+
+/*
+** Called after the last unmap, so no daemon access can race with the free.
+*/
+static int ring_dev_release(struct inode * inode, struct file * file)
+{
+	struct ring_area * area;
+
+	spin_lock(& ring_lock);
+	area = ring_area;
+	ring_area = NULL;
+	spin_unlock(& ring_lock);
+	vfree(area);
+	atomic_set(& ring_open, 0);
+
+	return 0;
+}
+
+static int ring_dev_mmap(struct file * file, struct vm_area_struct * vma)
+{
+	return remap_vmalloc_range(vma, ring_area, vma -> vm_pgoff);
+}
+
+static __poll_t ring_dev_poll(struct file * file, poll_table * wait)
+{
+	struct ring * sq = & ring_area -> sq;
+
+	poll_wait(file, & ring_wait, wait);
+	smp_mb();
+
+	return (smp_load_acquire(& sq -> head) != READ_ONCE(sq -> tail)) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+static ssize_t ring_dev_write(struct file * file, const char __user * buf, size_t count, loff_t * pos)
+{
+	ring_complete();
+
+	return count;
+}
+
+static const struct file_operations ring_fops =
+{
+	.owner = THIS_MODULE,
+	.open = ring_dev_open,
+	.release = ring_dev_release,
+	.mmap = ring_dev_mmap,
+	.poll = ring_dev_poll,
+	.write = ring_dev_write,
+	.llseek = noop_llseek,
+};
+
+static struct miscdevice ring_dev =
+{
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "safe",
+	.fops = & ring_fops,
+	.mode = 0600,
+};
+
+static bool ring_registered = false;
+
+static void __init ring_init(void)
+{
+	if (! ring_transport)
+	{
+		return;
+	}
+	if (misc_register(& ring_dev))
+	{
+		printk(KERN_NOTICE "[safe] Ring transport unavailable, using netlink only!\n");
+		return;
+	}
+	ring_registered = true;
+}
+
+static void __exit ring_exit(void)
+{
+	if (ring_registered)
+	{
+		misc_deregister(& ring_dev);
+	}
+}
@@ -0,0 +1,187 @@
+/*
+** In-memory ownership index of the whole safe table, which answers owner queries from
+** kernel space without touching the database.
+** This is an open addressing hash table with linear probing, keyed by inode number
+** (0 marks a free slot) through Fibonacci hashing, kept at most half full. Removal
+** shifts the following run of the cluster back, so there are no tombstones.
+** A slot is 16 bytes, so a probe usually stays within one cache line.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#define INDEX_MIN_SHIFT 10
+
+struct index_slot
+{
+	unsigned long ino;
+	uid_t uid;
+};
+
+struct index
+{
+	struct index_slot * slots;
+	unsigned long mask;
+	unsigned long count;
+	int shift;
+};
+
+static struct index owner_index;
+
+static unsigned long index_hash(unsigned long ino)
+{
+	return (ino * 0x9e3779b97f4a7c15UL) >> (64 - owner_index.shift);
+}
+
+/*
+** Allocate an empty table of 2^shift slots; return 0 on success, or -1.
+*/
+static int index_alloc(struct index * index, int shift)
+{
+	index -> slots = calloc(1UL << shift, sizeof(struct index_slot));
+	if (! index -> slots)
+	{
+		return -1;
+	}
+	index -> mask = (1UL << shift) - 1;
+	index -> count = 0;
+	index -> shift = shift;
+
+	return 0;
+}
+
+int index_init(void)
+{
+	return index_alloc(& owner_index, INDEX_MIN_SHIFT);
+}
+
+/*
+** Return the owner of inode, or 0 if it is not in safe.
+*/
+uid_t index_lookup(unsigned long ino)
+{
+	unsigned long i;
+
+	if (! ino)
+	{
+		return 0;
+	}
+	for (i = index_hash(ino); owner_index.slots[i].ino; i = (i + 1) & owner_index.mask)
+	{
+		if (owner_index.slots[i].ino == ino)
+		{
+			return owner_index.slots[i].uid;
+		}
+	}
+
+	return 0;
+}
+
+static void index_insert(unsigned long ino, uid_t uid)
+{
+	unsigned long i;
+
+	for (i = index_hash(ino); owner_index.slots[i].ino; i = (i + 1) & owner_index.mask)
+	{
+		if (owner_index.slots[i].ino == ino)
+		{
+			owner_index.slots[i].uid = uid;
+			return;
+		}
+	}
+	owner_index.slots[i].ino = ino;
+	owner_index.slots[i].uid = uid;
+	++ owner_index.count;
+}
+
+/*
+** Double the table; return 0 on success, or -1 if memory runs out, leaving it as is.
+*/
+static int index_grow(void)
+{
+	struct index old = owner_index;
+	unsigned long i;
+
+	if (index_alloc(& owner_index, old.shift + 1))
+	{
+		owner_index = old;
+		return -1;
+	}
+	for (i = 0; i <= old.mask; ++ i)
+	{
+		if (old.slots[i].ino)
+		{
+			index_insert(old.slots[i].ino, old.slots[i].uid);
+		}
+	}
+	free(old.slots);
+
+	return 0;
+}
+
+static void index_remove(unsigned long ino)
+{
+	unsigned long i, j, home;
+
+	for (i = index_hash(ino); owner_index.slots[i].ino != ino; i = (i + 1) & owner_index.mask)
+	{
+		if (! owner_index.slots[i].ino)
+		{
+			return;
+		}
+	}
+	/*
+	** Move back every later entry of the cluster whose home is not between the hole and it.
+	*/
+	for (j = (i + 1) & owner_index.mask; owner_index.slots[j].ino; j = (j + 1) & owner_index.mask)
+	{
+		home = index_hash(owner_index.slots[j].ino);
+		if (((j - home) & owner_index.mask) >= ((j - i) & owner_index.mask))
+		{
+			owner_index.slots[i] = owner_index.slots[j];
+			i = j;
+		}
+	}
+	owner_index.slots[i].ino = 0;
+	owner_index.slots[i].uid = 0;
+	-- owner_index.count;
+}
+
+/*
+** Record the owner of inode, where owner 0 means it has left the safe.
+** Return 0 on success, or -1 if the table is full and cannot grow, in which case the
+** index no longer reflects the table.
+*/
+int index_store(unsigned long ino, uid_t uid)
+{
+	if (! ino)
+	{
+		return 0;
+	}
+	if (! uid)
+	{
+		index_remove(ino);
+		return 0;
+	}
+	if (2 * (owner_index.count + 1) > owner_index.mask + 1 && index_grow()
+		&& 4 * (owner_index.count + 1) > 3 * (owner_index.mask + 1))
+	{
+		return -1;
+	}
+	index_insert(ino, uid);
+
+	return 0;
+}
+
+/*
+** Look up the owners of a batch of inodes; 0 for those not in safe.
+*/
+void index_get_owners(const unsigned long * inodes, unsigned int count, uid_t * uids)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; ++ i)
+	{
+		uids[i] = index_lookup(inodes[i]);
+	}
+}
@@ -6,6 +6,8 @@
 #include <ext2fs/ext2fs.h>
 #include <sys/stat.h>
 
+#define SAFE_DEVICE "/dev/sda1"
+
 static ext2_filsys current_fs;
 
 struct inode_walk_struct {
@@ -20,7 +22,7 @@ struct inode_walk_struct {
 
 void ext2fs_init(void)
 {
-	ext2fs_open("/dev/sda1", EXT2_FLAG_64BITS | EXT2_FLAG_SOFTSUPP_FEATURES, 0, 0, unix_io_manager, & current_fs);
+	ext2fs_open(SAFE_DEVICE, EXT2_FLAG_64BITS | EXT2_FLAG_SOFTSUPP_FEATURES, 0, 0, unix_io_manager, & current_fs);
 }
 
 static int ncheck_proc(struct ext2_dir_entry *dirent,
@@ -4,7 +4,6 @@
 */
 #define _GNU_SOURCE
 
-#include <sqlite3.h>
 #include <sys/un.h>
 #include <sys/socket.h>
 #include <linux/netlink.h>
@@ -13,30 +12,86 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/xattr.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <dirent.h>
 #include "ncheck.c"
-
-#define DB_PATH "/var/tmp/safe.db"
-#define CREATE "CREATE TABLE IF NOT EXISTS safe"\
-			"("									\
-				"inode INTEGER PRIMARY KEY,"	\
-				"owner INTEGER"					\
-			")"
-#define SELECT1 "SELECT inode FROM safe WHERE owner = %u"
-#define SELECT1_ROOT "SELECT inode, owner FROM safe"
-#define SELECT2 "SELECT owner FROM safe WHERE inode = %lu LIMIT 1"
-#define SELECT_CHECK "SELECT 1 FROM safe WHERE inode = %lu LIMIT 1"
-#define INSERT "INSERT INTO safe VALUES (%lu, %u)"
-#define DELETE "DELETE FROM safe WHERE inode = %lu"
+#include "index.c"
+#include "store.c"
 
 #define SOCK_PATH "/tmp/safe.socket"
+#define JOURNAL_DIR "/var/tmp/safe.journal"
+#define JOURNAL_DATA 4096
+#define CONVERT_CHUNK (4UL << 20)
+#define SAFE_XATTR "trusted.safe"
+#define RING_PATH "/dev/safe"
+#define RING_SIZE 4096
 #define NETLINK_SAFE 30
+#define SAFE_MSG_READY 0x10
+#define SAFE_MSG_OWNER 0x11
+#define SAFE_MSG_UPDATE 0x12
+#define SAFE_MSG_CENSUS 0x13
+#define SAFE_BATCH_MAX 1024
+#define WORKER_BATCH 16
+#define NLMSG_QUERY_SPACE NLMSG_SPACE(SAFE_BATCH_MAX * sizeof(unsigned long))
+#define CLIENT_TIMEOUT 5000
 
-char sql[64] = { 0 };
-sqlite3 * db;
-int req_len, rsp_len, rsp1_len, rc, server_sock, client_sock;
+int server_sock, notify_sock;
+/*
+** The client side pushes every change of the safe table through index_pipe to the
+** kernel side, which answers owner queries from its in-memory index while index_ok.
+** index_pushed, shared by both sides, counts the changes pushed, and index_applied
+** those applied, so the kernel side only takes index_lock for writing when it is behind.
+*/
+int index_pipe[2], index_ok;
+unsigned long * index_pushed, index_applied;
+/*
+** set by the kernel side, shared with the client side, once kernel space knows the daemon
+*/
+int * kernel_ready;
+pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+/*
+** census of the safe table, counted once at startup, then kept by the client side as rows
+** come and go, so a change publishes it without counting rows; census_lock keeps census
+** messages in the order of the changes
+*/
+long census_count, census_unmarked;
+pthread_mutex_t census_lock = PTHREAD_MUTEX_INITIALIZER;
+/*
+** number of threads answering owner queries, and serving slow client requests,
+** one per cpu each by default
+*/
+int workers, client_workers;
+/*
+** shared memory rings mapped from RING_PATH, NULL if kernel space does not offer them
+** Workers claim submissions by moving the tail with compare-and-swap, and produce
+** completions under ring_lock.
+*/
+struct ring_area * ring_area;
+int ring_fd = -1;
+pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+/*
+** The client side multiplexes its connections in epoll_fd, and queues slow requests
+** from job_head to job_tail for its worker threads. ncheck.c is not thread safe, so
+** filesystem lookups go through fs_lock.
+*/
+int epoll_fd;
+struct client * job_head, ** job_tail = & job_head;
+pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /*
 ** request from client
+** A connection carries any number of requests, answered in order, except that op 1
+** ends it, as its file list is terminated by EOF.
 ** op	|ino|operation
 ** 1	|0	|list all files owned by specific user; for root this means all files
 ** 2	|	|check if file is protected by specific user; for root this gets file owner
@@ -47,271 +102,1367 @@ struct req
 {
 	unsigned char op;
 	unsigned long ino;
-} reqbuf;
+};
+
+/*
+** response to client for op != 1
+** There are 3 flag bits in stat
+** 4			|2				|1
+** owner error	|existence error|operation error
+** For example,
+** op = 4, the existence bit means file to insert is already in database;
+** op = 8, the existence bit means file to delete is not in database, etc.
+** uid is only activated when root requesting op = 2
+*/
+union rsp
+{
+	unsigned int stat;
+	uid_t uid;
+};
+
+/*
+** response to client for op == 1
+** This responses with owner uid and file pathname
+*/
+struct rsp1
+{
+	uid_t uid;
+	char filename[4096];
+};
+
+/*
+** client connection, registered in epoll_fd with EPOLLONESHOT, so a single thread
+** serves it at a time; req collects a request across partial reads
+** The socket never blocks. A reply the epoll thread could not send whole waits in out,
+** and the client is only polled for writing until it is flushed.
+*/
+struct client
+{
+	int sock;
+	uid_t uid;
+	struct req req;
+	size_t got;
+	union rsp out;
+	size_t out_len;
+	struct client * next;
+};
+
+/*
+** owner query from kernel space, answered with one uid per inode in order
+*/
+struct owners
+{
+	unsigned long * inodes;
+	unsigned int count;
+	uid_t * uids;
+};
+
+/*
+** shared memory rings mapped from RING_PATH, laid out as in kernel space
+** sq carries (seq, index, inode) owner queries, cq carries (seq, index, uid) answers
+*/
+struct ring_entry
+{
+	unsigned int seq;
+	unsigned int index;
+	unsigned long value;
+};
+
+struct ring
+{
+	unsigned int head __attribute__((aligned(64)));
+	unsigned int tail __attribute__((aligned(64)));
+	struct ring_entry entries[RING_SIZE] __attribute__((aligned(64)));
+};
+
+struct ring_area
+{
+	struct ring sq;
+	struct ring cq;
+};
+
+/*
+** protection marker stored in SAFE_XATTR of every protected file
+** The inode number binds the marker to its file, so a copied xattr is not trusted.
+*/
+struct marker
+{
+	unsigned long ino;
+	uid_t uid;
+};
+
+/*
+** header of the journal of a conversion, in JOURNAL_DIR under the inode number
+** Two slots of CONVERT_CHUNK bytes follow from JOURNAL_DATA on, and slot keeps the
+** chunk at offset as it was read before conversion, len bytes of it, so a conversion
+** interrupted while rewriting that chunk can put it back and resume from there.
+** Every chunk before offset is converted, none after it is, and conversion stops at end,
+** or at the end of file if end is 0. The header fits a sector, so it is written atomically.
+** A failed conversion is rolled back by converting the other way up to where it stopped.
+*/
+struct journal
+{
+	unsigned long ino;
+	uid_t owner;
+	int protect;	// 1 while encrypting for insert, 0 while decrypting for delete
+	unsigned long offset;
+	unsigned long len;
+	unsigned long end;
+	int slot;
+	int done;
+	int rollback;	// 1 while undoing the request rather than carrying it out
+};
+
+/*
+** census of the safe table to kernel space
+** Once no row is unmarked, kernel space trusts a missing marker on dev to mean unprotected.
+*/
+struct census
+{
+	unsigned long count;
+	unsigned long unmarked;
+	unsigned long dev;
+};
+
+/*
+** update to kernel space when a row of the safe table changes
+** uid 0 means the inode has left the safe
+*/
+struct update
+{
+	unsigned long ino;
+	uid_t uid;
+};
+
+/*
+** Look up the owners of a batch of inodes; 0 for those not in safe.
+*/
+void select_get_owners(unsigned long * inodes, unsigned int count, uid_t * uids)
+{
+	unsigned int i;
+	int rc;
+
+	for (i = 0; i < count; ++ i)
+	{
+		uids[i] = (uid_t)store_value(SELECT2, inodes[i], & rc);
+	}
+}
+
+/*
+** Load the whole safe table into the in-memory index; index_ok tells whether that worked.
+*/
+void load_index(void)
+{
+	sqlite3_stmt * stmt;
+
+	index_ok = ! index_init();
+	stmt = store_stmt(SELECT1_ROOT, 0, 0);
+	while (index_ok && stmt && sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		if (index_store((unsigned long)sqlite3_column_int64(stmt, 0), (uid_t)sqlite3_column_int64(stmt, 1)))
+		{
+			index_ok = 0;
+		}
+	}
+	if (stmt)
+	{
+		sqlite3_reset(stmt);
+	}
+}
+
+/*
+** Apply the changes the client side pushed since last time. Since they are pushed before
+** kernel space learns of them, a query which follows such a change always sees it here.
+*/
+void sync_index(void)
+{
+	struct update upd;
+
+	if (__atomic_load_n(index_pushed, __ATOMIC_ACQUIRE) == __atomic_load_n(& index_applied, __ATOMIC_RELAXED))
+	{
+		return;
+	}
+	pthread_rwlock_wrlock(& index_lock);
+	while (read(index_pipe[0], & upd, sizeof(struct update)) == sizeof(struct update))
+	{
+		if (index_ok && index_store(upd.ino, upd.uid))
+		{
+			index_ok = 0;
+		}
+		__atomic_add_fetch(& index_applied, 1, __ATOMIC_RELAXED);
+	}
+	pthread_rwlock_unlock(& index_lock);
+}
+
+/*
+** Look up the owners of a batch of inodes, from the index unless it failed.
+** This is called from every worker thread.
+*/
+void get_owners(unsigned long * inodes, unsigned int count, uid_t * uids)
+{
+	sync_index();
+	pthread_rwlock_rdlock(& index_lock);
+	if (index_ok)
+	{
+		index_get_owners(inodes, count, uids);
+		pthread_rwlock_unlock(& index_lock);
+		return;
+	}
+	pthread_rwlock_unlock(& index_lock);
+	select_get_owners(inodes, count, uids);
+}
+
+/*
+** Answer every owner query pending in the submission ring, SAFE_BATCH_MAX per query,
+** then write to the device so kernel space drains the completion ring.
+** Entries are copied out before the tail is moved past them, since kernel space may
+** reuse their slots from then on; if another worker moved it first, the copy is dropped.
+*/
+void drain_ring(void)
+{
+	unsigned long inodes[SAFE_BATCH_MAX];
+	unsigned int seqs[SAFE_BATCH_MAX], indexes[SAFE_BATCH_MAX];
+	uid_t uids[SAFE_BATCH_MAX];
+	struct ring_entry * e;
+	unsigned int head, tail, cq_head, room, n, m, i;
+
+	tail = __atomic_load_n(& ring_area -> sq.tail, __ATOMIC_ACQUIRE);
+	while (1)
+	{
+		head = __atomic_load_n(& ring_area -> sq.head, __ATOMIC_ACQUIRE);
+		if (tail == head)
+		{
+			break;
+		}
+		for (n = 0; tail + n != head && n < SAFE_BATCH_MAX; ++ n)
+		{
+			e = & ring_area -> sq.entries[(tail + n) & (RING_SIZE - 1)];
+			seqs[n] = e -> seq;
+			indexes[n] = e -> index;
+			inodes[n] = e -> value;
+		}
+		if (! __atomic_compare_exchange_n(& ring_area -> sq.tail, & tail, tail + n, 0, __ATOMIC_ACQ_REL,
+			__ATOMIC_ACQUIRE))
+		{
+			continue;
+		}
+		tail += n;
+		get_owners(inodes, n, uids);
+		/*
+		** Completions only go to free room of the completion ring; while it is full,
+		** kernel space is made to drain it.
+		*/
+		pthread_mutex_lock(& ring_lock);
+		for (i = 0; i < n; i += room)
+		{
+			cq_head = ring_area -> cq.head;
+			room = RING_SIZE - (cq_head - __atomic_load_n(& ring_area -> cq.tail, __ATOMIC_ACQUIRE));
+			if (room > n - i)
+			{
+				room = n - i;
+			}
+			if (! room && write(ring_fd, "", 1) == -1)
+			{
+				break;
+			}
+			for (m = 0; m < room; ++ m)
+			{
+				e = & ring_area -> cq.entries[(cq_head + m) & (RING_SIZE - 1)];
+				e -> seq = seqs[i + m];
+				e -> index = indexes[i + m];
+				e -> value = uids[i + m];
+			}
+			__atomic_store_n(& ring_area -> cq.head, cq_head + room, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(& ring_lock);
+		write(ring_fd, "", 1);
+	}
+}
+
+/*
+** Worker thread answering owner queries from both transports: the shared memory rings
+** while kernel space offers them, which it prefers, and netlink, up to WORKER_BATCH per
+** system call each way. Kernel space only sends owner queries on netlink, and each reply
+** reuses the query header.
+*/
+void * worker(void * arg)
+{
+	struct sockaddr_nl dest_sockaddr;
+	struct mmsghdr queries[WORKER_BATCH], replies[WORKER_BATCH];
+	struct iovec iovs[WORKER_BATCH];
+	struct nlmsghdr * nlh;
+	struct pollfd fds[2];
+	uid_t owners[SAFE_BATCH_MAX];
+	char * bufs;
+	unsigned int count;
+	int n, m, i;
+
+	bufs = malloc(WORKER_BATCH * NLMSG_QUERY_SPACE);
+	if (! bufs || store_open())
+	{
+		return NULL;
+	}
+	memset(& dest_sockaddr, 0, sizeof(struct sockaddr_nl));
+	dest_sockaddr.nl_family = AF_NETLINK;
+	memset(queries, 0, sizeof(queries));
+	memset(replies, 0, sizeof(replies));
+	for (i = 0; i < WORKER_BATCH; ++ i)
+	{
+		iovs[i].iov_base = bufs + i * NLMSG_QUERY_SPACE;
+		queries[i].msg_hdr.msg_iov = & iovs[i];
+		queries[i].msg_hdr.msg_iovlen = 1;
+	}
+	fds[0].fd = server_sock;
+	fds[0].events = POLLIN;
+	fds[1].fd = ring_area ? ring_fd : -1;
+	fds[1].events = POLLIN;
+	while (1)
+	{
+		if (poll(fds, 2, -1) == -1)
+		{
+			continue;
+		}
+		if (fds[1].revents & POLLIN)
+		{
+			drain_ring();
+		}
+		if (! (fds[0].revents & POLLIN))
+		{
+			continue;
+		}
+		for (i = 0; i < WORKER_BATCH; ++ i)
+		{
+			iovs[i].iov_len = NLMSG_QUERY_SPACE;
+		}
+		n = recvmmsg(server_sock, queries, WORKER_BATCH, MSG_DONTWAIT, NULL);
+		for (i = 0, m = 0; i < n; ++ i)
+		{
+			nlh = (struct nlmsghdr *)iovs[i].iov_base;
+			if (queries[i].msg_len < NLMSG_HDRLEN || nlh -> nlmsg_len > queries[i].msg_len)
+			{
+				continue;
+			}
+			count = (nlh -> nlmsg_len - NLMSG_HDRLEN) / sizeof(unsigned long);
+			if (count > SAFE_BATCH_MAX)
+			{
+				count = SAFE_BATCH_MAX;
+			}
+			get_owners((unsigned long *)NLMSG_DATA(nlh), count, owners);
+			memcpy(NLMSG_DATA(nlh), owners, count * sizeof(uid_t));
+			nlh -> nlmsg_len = NLMSG_LENGTH(count * sizeof(uid_t));
+			iovs[i].iov_len = nlh -> nlmsg_len;
+			replies[m].msg_hdr.msg_name = (void *)& dest_sockaddr;
+			replies[m].msg_hdr.msg_namelen = sizeof(struct sockaddr_nl);
+			replies[m].msg_hdr.msg_iov = & iovs[i];
+			replies[m].msg_hdr.msg_iovlen = 1;
+			++ m;
+		}
+		if (m)
+		{
+			sendmmsg(server_sock, replies, m, 0);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+** Publish the census of the safe table to kernel space.
+** While the count is 0, the hooked syscalls skip every privilege check.
+** No census goes out while SAFE_DEVICE cannot be resolved: kernel space then keeps
+** checking every device, rather than being told a device which matches none.
+*/
+void publish_census(int sock, long count, long unmarked)
+{
+	struct sockaddr_nl dest_sockaddr;
+	struct stat statbuf;
+	struct
+	{
+		struct nlmsghdr nlh;
+		struct census census;
+	} msg;
+
+	memset(& dest_sockaddr, 0, sizeof(struct sockaddr_nl));
+	memset(& msg, 0, sizeof(msg));
+	dest_sockaddr.nl_family = AF_NETLINK;
+	msg.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(struct census));
+	msg.nlh.nlmsg_type = SAFE_MSG_CENSUS;
+	if (stat(SAFE_DEVICE, & statbuf) || ! S_ISBLK(statbuf.st_mode) || ! statbuf.st_rdev)
+	{
+		printf("%s\n", "CENSUS ERROR: " SAFE_DEVICE " NOT FOUND");
+		return;
+	}
+	msg.census.count = count;
+	msg.census.unmarked = unmarked;
+	msg.census.dev = statbuf.st_rdev;
+	sendto(sock, & msg, sizeof(msg), 0, (struct sockaddr *)& dest_sockaddr, sizeof(struct sockaddr_nl));
+}
+
+/*
+** Set the euid of the calling thread only; the seteuid() wrapper would apply it to
+** every thread of the process.
+*/
+void set_euid(uid_t euid)
+{
+	syscall(SYS_setresuid, -1, euid, -1);
+}
+
+/*
+** Thread safe wrappers of ncheck.c.
+*/
+void lookup_filename(unsigned long inode, char * filename)
+{
+	filename[0] = 0;
+	pthread_mutex_lock(& fs_lock);
+	get_filename_from_ino(inode, filename);
+	pthread_mutex_unlock(& fs_lock);
+}
+
+uid_t lookup_owner(unsigned long inode)
+{
+	uid_t owner;
+
+	pthread_mutex_lock(& fs_lock);
+	owner = get_owner_from_ino(inode);
+	pthread_mutex_unlock(& fs_lock);
+
+	return owner;
+}
+
+/*
+** Set (owner != 0) or clear the protection marker of a file, and return 1 if that worked.
+** Trusted xattrs need CAP_SYS_ADMIN, so root privileges are regained around the call.
+** Clearing a marker that does not exist counts as success.
+*/
+int set_marker(const char * filename, unsigned long inode, uid_t owner)
+{
+	struct marker marker = { inode, owner };
+	uid_t euid = geteuid();
+	int ret;
+
+	set_euid(0);
+	if (owner)
+	{
+		ret = ! lsetxattr(filename, SAFE_XATTR, & marker, sizeof(struct marker), 0);
+	}
+	else
+	{
+		ret = ! lremovexattr(filename, SAFE_XATTR) || errno == ENODATA || errno == ENOTSUP;
+	}
+	set_euid(euid);
+
+	return ret;
+}
+
+/*
+** Tell kernel space the owner of inode, 0 if it is not in safe, replacing whatever its
+** ownership cache holds; that includes an answer read from a marker since changed back.
+*/
+void send_update(unsigned long inode, uid_t owner)
+{
+	struct sockaddr_nl dest_sockaddr;
+	struct
+	{
+		struct nlmsghdr nlh;
+		struct update upd;
+	} msg;
+
+	memset(& dest_sockaddr, 0, sizeof(struct sockaddr_nl));
+	memset(& msg, 0, sizeof(msg));
+	dest_sockaddr.nl_family = AF_NETLINK;
+	msg.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(struct update));
+	msg.nlh.nlmsg_type = SAFE_MSG_UPDATE;
+	msg.upd.ino = inode;
+	msg.upd.uid = owner;
+	sendto(notify_sock, & msg, sizeof(msg), 0, (struct sockaddr *)& dest_sockaddr, sizeof(struct sockaddr_nl));
+}
+
+/*
+** Push a changed row to the kernel side index, then to kernel space, so its ownership
+** cache stays coherent, along with the census; unmarked tells whether the row is unmarked.
+** This must happen before the file is rewritten, so the rewrite is transformed.
+*/
+void notify_kernel(unsigned long inode, uid_t owner, int unmarked)
+{
+	struct update upd = { inode, owner };
+
+	write(index_pipe[1], & upd, sizeof(struct update));
+	__atomic_add_fetch(index_pushed, 1, __ATOMIC_RELEASE);
+	send_update(inode, owner);
+	pthread_mutex_lock(& census_lock);
+	census_count += owner ? 1 : -1;
+	census_unmarked += owner ? unmarked : - unmarked;
+	publish_census(notify_sock, census_count, census_unmarked);
+	pthread_mutex_unlock(& census_lock);
+}
+
+/*
+** Record inode in the safe table, mark its file, and tell kernel space.
+** The row and its mark are committed together, and the marker is cleared again if
+** that fails. A file which cannot be marked stays protected, only through the table.
+** Return 0 on success, or 1 on failure.
+*/
+int protect(unsigned long inode, uid_t owner, const char * filename)
+{
+	int marked;
+
+	if (store_exec(BEGIN, 0, 0) != SQLITE_OK)
+	{
+		return 1;
+	}
+	if (store_exec(INSERT, inode, owner) != SQLITE_OK)
+	{
+		store_exec(ROLLBACK, 0, 0);
+		return 1;
+	}
+	marked = set_marker(filename, inode, owner);
+	if (marked)
+	{
+		store_exec(MARK, inode, 0);
+	}
+	if (store_exec(COMMIT, 0, 0) != SQLITE_OK)
+	{
+		store_exec(ROLLBACK, 0, 0);
+		if (marked)
+		{
+			set_marker(filename, inode, 0);
+			send_update(inode, 0);
+		}
+		return 1;
+	}
+	notify_kernel(inode, owner, ! marked);
+
+	return 0;
+}
+
+/*
+** Clear the marker of a file, remove inode from the safe table, and tell kernel space.
+** The marker goes first, so a failure never leaves a stale marker behind a deleted row.
+** Kernel space may have cached the cleared marker meanwhile, so when the marker is put
+** back, kernel space is told the owner again.
+** Return 0 on success, or 1 on failure.
+*/
+int unprotect(unsigned long inode, uid_t owner, const char * filename)
+{
+	int marked, rc;
+
+	if (! set_marker(filename, inode, 0))
+	{
+		return 1;
+	}
+	/*
+	** If this cannot tell, the row counts as marked, so the census never undercounts
+	** unmarked rows.
+	*/
+	marked = store_value(SELECT_MARKED, inode, & rc) || rc != SQLITE_OK;
+	if (store_exec(DELETE, inode, 0) != SQLITE_OK)
+	{
+		set_marker(filename, inode, owner);
+		send_update(inode, owner);
+		return 1;
+	}
+	notify_kernel(inode, 0, ! marked);
+
+	return 0;
+}
+
+/*
+** Mark the files of rows recorded before markers existed. This runs once at startup,
+** and each file name costs a scan of the filesystem, but later starts find nothing to do.
+** Every mark is committed in a single transaction.
+*/
+void mark_rows(void)
+{
+	sqlite3_stmt * stmt = store_stmt(SELECT_UNMARKED, 0, 0);
+	unsigned long * inodes = NULL;
+	uid_t * uids = NULL;
+	unsigned int count = 0, i;
+	char filename[4096];
+
+	while (stmt && sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		if (! (count & (count + 1)))
+		{
+			inodes = realloc(inodes, 2 * (count + 1) * sizeof(unsigned long));
+			uids = realloc(uids, 2 * (count + 1) * sizeof(uid_t));
+		}
+		inodes[count] = (unsigned long)sqlite3_column_int64(stmt, 0);
+		uids[count] = (uid_t)sqlite3_column_int64(stmt, 1);
+		++ count;
+	}
+	if (stmt)
+	{
+		sqlite3_reset(stmt);
+	}
+	if (count && store_exec(BEGIN, 0, 0) == SQLITE_OK)
+	{
+		for (i = 0; i < count; ++ i)
+		{
+			filename[0] = 0;
+			get_filename_from_ino(inodes[i], filename);
+			if (filename[0] && set_marker(filename, inodes[i], uids[i]))
+			{
+				store_exec(MARK, inodes[i], 0);
+			}
+		}
+		if (store_exec(COMMIT, 0, 0) != SQLITE_OK)
+		{
+			store_exec(ROLLBACK, 0, 0);
+		}
+	}
+	free(inodes);
+	free(uids);
+}
+
+/*
+** Stream the files of owner to the client, or every file with its owner for root.
+** The owner index serves the former.
+*/
+/*
+** Send len bytes of buf to client from a worker thread, waiting for it to read at most
+** CLIENT_TIMEOUT ms in all, so a client which stops reading cannot hold the worker.
+** Return 0 once all is sent, or -1 if the client is to be dropped.
+*/
+int client_send(struct client * client, const void * buf, size_t len)
+{
+	struct pollfd pfd;
+	struct timespec now, deadline;
+	long timeout;
+	ssize_t n;
+
+	pfd.fd = client -> sock;
+	pfd.events = POLLOUT;
+	clock_gettime(CLOCK_MONOTONIC, & deadline);
+	deadline.tv_sec += CLIENT_TIMEOUT / 1000;
+	while (len)
+	{
+		n = send(client -> sock, buf, len, MSG_NOSIGNAL);
+		if (n > 0)
+		{
+			buf = (const char *)buf + n;
+			len -= n;
+			continue;
+		}
+		if (n == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n == 0 || errno != EAGAIN)
+		{
+			return -1;
+		}
+		clock_gettime(CLOCK_MONOTONIC, & now);
+		timeout = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+		if (timeout <= 0 || poll(& pfd, 1, timeout) != 1)
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+** Send a reply to client from the epoll thread, which must never block: whatever the
+** socket does not take now waits in client -> out. Return -1 if the client is to be dropped.
+*/
+int client_queue(struct client * client, const union rsp * rsp)
+{
+	ssize_t n;
+
+	n = send(client -> sock, rsp, sizeof(union rsp), MSG_NOSIGNAL);
+	if (n == -1 && errno != EAGAIN && errno != EINTR)
+	{
+		return -1;
+	}
+	if (n < 0)
+	{
+		n = 0;
+	}
+	client -> out_len = sizeof(union rsp) - n;
+	memcpy(& client -> out, (const char *)rsp + n, client -> out_len);
+
+	return 0;
+}
+
+/*
+** Send the rest of the pending reply of client; return -1 if it is to be dropped.
+*/
+int client_flush(struct client * client)
+{
+	ssize_t n;
+
+	n = send(client -> sock, & client -> out, client -> out_len, MSG_NOSIGNAL);
+	if (n == -1)
+	{
+		return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+	}
+	client -> out_len -= n;
+	memmove(& client -> out, (const char *)& client -> out + n, client -> out_len);
+
+	return 0;
+}
+
+int select_get_filelist(struct client * client, uid_t owner)
+{
+	sqlite3_stmt * stmt = store_stmt(owner ? SELECT1 : SELECT1_ROOT, owner, 0);
+	struct rsp1 rsp1;
+	int ret = 0;
+
+	rsp1.uid = owner;
+	while (stmt && sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		if (! owner)	// request from root
+		{
+			rsp1.uid = (uid_t)sqlite3_column_int64(stmt, 1);
+		}
+		lookup_filename((unsigned long)sqlite3_column_int64(stmt, 0), rsp1.filename);
+		ret = client_send(client, & rsp1, sizeof(struct rsp1));
+		if (ret)
+		{
+			break;
+		}
+	}
+	if (stmt)
+	{
+		sqlite3_reset(stmt);
+	}
+
+	return ret;
+}
+
+int select_get_fileowner_or_check(struct client * client, unsigned long inode, uid_t owner)
+{
+	union rsp rsp;
+	uid_t result;
+	int rc;
+
+	result = (uid_t)store_value(SELECT2, inode, & rc);
+	if (owner)	// for normal user check protection
+	{
+		rsp.stat = (owner == result) ? 0 : 4;
+	}
+	else	// for root get owner
+	{
+		rsp.uid = (unsigned long)result;
+	}
+	if (rc != SQLITE_OK)
+	{
+		rsp.stat = 1;
+	}
+
+	return client_queue(client, & rsp);
+}
+
+void journal_path(unsigned long inode, char * path)
+{
+	snprintf(path, 64, "%s/%lu", JOURNAL_DIR, inode);
+}
+
+/*
+** Write the header of a journal through to disk; return 0 on success, or -1.
+*/
+int journal_write(int jfd, const struct journal * j)
+{
+	if (pwrite(jfd, j, sizeof(struct journal), 0) != sizeof(struct journal) || fdatasync(jfd))
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+** Remove the journal at path, overwriting its slots first, as they hold plaintext.
+*/
+void journal_remove(int jfd, const char * path)
+{
+	static const char zeros[JOURNAL_DATA];
+	struct stat statbuf;
+	off_t offset;
+
+	if (! fstat(jfd, & statbuf))
+	{
+		for (offset = JOURNAL_DATA; offset < statbuf.st_size; offset += JOURNAL_DATA)
+		{
+			if (pwrite(jfd, zeros, JOURNAL_DATA, offset) != JOURNAL_DATA)
+			{
+				break;
+			}
+		}
+		fdatasync(jfd);
+	}
+	unlink(path);
+}
 
 /*
-** response to client for op != 1
-** There are 3 flag bits in stat
-** 4			|2				|1
-** owner error	|existence error|operation error
-** For example,
-** op = 4, the existence bit means file to insert is already in database;
-** op = 8, the existence bit means file to delete is not in database, etc.
-** uid is only activated when root requesting op = 2
+** Put back the chunk j records as possibly half rewritten, as it was read before conversion;
+** return 0 on success, or 1 on failure.
 */
-union rsp
+int journal_restore(int fd, int jfd, const struct journal * j, char * buf)
 {
-	unsigned int stat;
-	uid_t uid;
-} rspbuf;
+	int status = 0;
+
+	if (! j -> done && j -> len)
+	{
+		set_euid(j -> protect ? 0 : j -> owner);
+		if (pread(jfd, buf, j -> len, JOURNAL_DATA + j -> slot * CONVERT_CHUNK) != (ssize_t)j -> len
+			|| pwrite(fd, buf, j -> len, j -> offset) != (ssize_t)j -> len)
+		{
+			status = 1;
+		}
+		set_euid(0);
+	}
+
+	return status;
+}
 
 /*
-** response to client for op == 1
-** This responses with owner uid and file pathname
+** Rewrite the file from j -> offset on, CONVERT_CHUNK bytes at a time, reading each chunk
+** as src and writing it back as dst, so kernel space transforms it on one side only:
+** root reads and writes raw, the owner reads and writes through the cipher.
+** Every chunk is saved in the journal slot the header does not point to, and the chunk
+** before is synced, before the header moves on. Return 0 on success, or 1 on failure.
 */
-struct rsp1
+int convert_chunks(int fd, int jfd, struct journal * j, char * buf)
 {
-	uid_t uid;
-	char filename[4096];
-} rsp1buf;
+	uid_t src = j -> protect ? 0 : j -> owner, dst = j -> protect ? j -> owner : 0;
+	off_t offset = j -> offset;
+	size_t want;
+	ssize_t n;
+
+	while (1)
+	{
+		want = CONVERT_CHUNK;
+		if (j -> end && (unsigned long)offset + want > j -> end)
+		{
+			want = (unsigned long)offset < j -> end ? j -> end - offset : 0;
+		}
+		set_euid(src);
+		n = want ? pread(fd, buf, want, offset) : 0;
+		set_euid(0);
+		if (n <= 0)
+		{
+			break;
+		}
+		if (pwrite(jfd, buf, n, JOURNAL_DATA + (j -> slot ^ 1) * CONVERT_CHUNK) != n || fdatasync(jfd) || fdatasync(fd))
+		{
+			return 1;
+		}
+		if (offset > (off_t)j -> offset)
+		{
+			posix_fadvise(fd, j -> offset, offset - j -> offset, POSIX_FADV_DONTNEED);
+		}
+		j -> offset = offset;
+		j -> len = n;
+		j -> slot ^= 1;
+		if (journal_write(jfd, j))
+		{
+			return 1;
+		}
+		set_euid(dst);
+		n = pwrite(fd, buf, j -> len, offset);
+		set_euid(0);
+		if (n != (ssize_t)j -> len)
+		{
+			return 1;
+		}
+		offset += n;
+	}
+	if (n < 0 || fdatasync(fd))
+	{
+		return 1;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	j -> offset = offset;
+	j -> len = 0;
+	j -> done = 1;
 
-static int callback_get_filelist(void * NotUsed, int argc, char ** argv, char ** azColName)
+	return journal_write(jfd, j) ? 1 : 0;
+}
+
+/*
+** Carry out the conversion j records on the file, from where it stopped: put back the
+** chunk which may have been half rewritten, convert the rest, and once the file is
+** decrypted, remove it from safe at last, or convert it back if that fails.
+** Return 0 on success, 2 if the file was converted back, or 1 on failure, leaving the
+** journal to resume from.
+*/
+int convert_run(int fd, int jfd, struct journal * j, const char * filename)
 {
-	unsigned long inode = (unsigned long)atol(argv[0]);
+	char * buf;
+	int status = 1;
 
-	get_filename_from_ino(inode, rsp1buf.filename);
-	send(client_sock, & rsp1buf, rsp1_len, 0);
+	buf = malloc(CONVERT_CHUNK);
+	if (! buf)
+	{
+		return 1;
+	}
+	if (journal_restore(fd, jfd, j, buf) || (! j -> done && convert_chunks(fd, jfd, j, buf)))
+	{
+		goto out;
+	}
+	if (! j -> protect && unprotect(j -> ino, j -> owner, filename))
+	{
+		j -> protect = j -> rollback = 1;
+		j -> offset = j -> len = j -> end = j -> slot = j -> done = 0;
+		if (journal_write(jfd, j) || convert_chunks(fd, jfd, j, buf))
+		{
+			goto out;
+		}
+	}
+	status = j -> rollback ? 2 : 0;
+out:
+	memset(buf, 0, CONVERT_CHUNK);
+	free(buf);
 
-	return 0;
+	return status;
 }
 
-static int callback_get_filelist_root(void * NotUsed, int argc, char ** argv, char ** azColName)
+/*
+** Recover from a conversion which failed at runtime: resume it from its journal, as a
+** restart would, and if that fails again, convert back what it had converted, so the
+** file is left as before the request. Return as convert_run.
+*/
+int convert_recover(int fd, int jfd, struct journal * j, const char * filename)
 {
-	unsigned long inode = (unsigned long)atol(argv[0]);
+	char * buf;
+	int status;
 
-	rsp1buf.uid = (uid_t)atoi(argv[1]);
-	get_filename_from_ino(inode, rsp1buf.filename);
-	send(client_sock, & rsp1buf, rsp1_len, 0);
+	if (pread(jfd, j, sizeof(struct journal), 0) != sizeof(struct journal))
+	{
+		return 1;
+	}
+	status = convert_run(fd, jfd, j, filename);
+	if (status != 1 || pread(jfd, j, sizeof(struct journal), 0) != sizeof(struct journal) || j -> done
+		|| j -> rollback)
+	{
+		return status;
+	}
+	buf = malloc(CONVERT_CHUNK);
+	if (! buf)
+	{
+		return 1;
+	}
+	status = journal_restore(fd, jfd, j, buf);
+	memset(buf, 0, CONVERT_CHUNK);
+	free(buf);
+	if (status)
+	{
+		return 1;
+	}
+	/*
+	** Nothing was converted yet if it stopped in the first chunk, and end 0 means the whole file.
+	*/
+	j -> end = j -> offset;
+	j -> done = ! j -> end;
+	j -> protect ^= 1;
+	j -> rollback = 1;
+	j -> offset = j -> len = j -> slot = 0;
+	if (journal_write(jfd, j))
+	{
+		return 1;
+	}
 
-	return 0;
+	return convert_run(fd, jfd, j, filename);
 }
 
-static int callback_get_fileowner_or_check(void * result, int argc, char ** argv, char ** azColName)
+/*
+** Convert the file of inode in place for owner, encrypting it if protecting, else
+** decrypting it, with constant memory and a journal, so a crash never leaves a chunk
+** converted twice or not at all. Files other than regular ones are only (un)protected.
+** Return 0 on success, or 1 on failure.
+** The calling thread takes owner as euid at times, which leaves other threads alone.
+*/
+int convert(unsigned long inode, uid_t owner, int protecting)
 {
-	* (uid_t *)result = atoi(* argv);
+	struct journal j = { inode, owner, protecting, 0, 0, 0, 0, 0, 0 };
+	char filename[4096], path[64];
+	struct stat statbuf;
+	int fd, jfd, dfd, status = 1;
 
-	return 0;
+	lookup_filename(inode, filename);
+	if (stat(filename, & statbuf) || ! S_ISREG(statbuf.st_mode))
+	{
+		return protecting ? protect(inode, owner, filename) : unprotect(inode, owner, filename);
+	}
+	fd = open(filename, O_RDWR);
+	if (fd == -1)
+	{
+		return 1;
+	}
+	journal_path(inode, path);
+	jfd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (jfd == -1)
+	{
+		close(fd);
+		return 1;
+	}
+	dfd = open(JOURNAL_DIR, O_RDONLY | O_DIRECTORY);
+	if (journal_write(jfd, & j) || dfd == -1 || fsync(dfd) || (protecting && protect(inode, owner, filename)))
+	{
+		unlink(path);
+	}
+	else
+	{
+		status = convert_run(fd, jfd, & j, filename);
+		if (status == 1)
+		{
+			status = convert_recover(fd, jfd, & j, filename);
+		}
+		if (status != 1)
+		{
+			journal_remove(jfd, path);
+		}
+		status = !! status;
+	}
+	if (dfd != -1)
+	{
+		close(dfd);
+	}
+	close(jfd);
+	close(fd);
+
+	return status;
 }
 
-void select_get_filelist(uid_t owner)
+/*
+** Resume the conversion recorded in journal name, as far as it still applies.
+*/
+void resume(const char * name)
 {
-	if (owner)	// request not from root
+	struct journal j;
+	char filename[4096], path[64];
+	uid_t owner;
+	int fd, jfd, rc;
+
+	snprintf(path, sizeof(path), "%s/%s", JOURNAL_DIR, name);
+	jfd = open(path, O_RDWR);
+	if (jfd == -1)
 	{
-		rsp1buf.uid = owner;
-		snprintf(sql, 63, SELECT1, owner);
-		rc = sqlite3_exec(db, sql, callback_get_filelist, 0, NULL);
+		return;
 	}
-	else	// request from root
+	if (pread(jfd, & j, sizeof(struct journal), 0) != sizeof(struct journal))
 	{
-		strcpy(sql, SELECT1_ROOT);
-		rc = sqlite3_exec(db, sql, callback_get_filelist_root, 0, NULL);
+		journal_remove(jfd, path);
+		close(jfd);
+		return;
 	}
+	owner = (uid_t)store_value(SELECT2, j.ino, & rc);
+	if (rc != SQLITE_OK)
+	{
+		close(jfd);
+		return;
+	}
+	/*
+	** Insert stopped before the row was recorded, or delete after it was removed.
+	*/
+	if (owner != j.owner)
+	{
+		journal_remove(jfd, path);
+		close(jfd);
+		return;
+	}
+	lookup_filename(j.ino, filename);
+	fd = filename[0] ? open(filename, O_RDWR) : -1;
+	if (fd != -1)
+	{
+		if (convert_run(fd, jfd, & j, filename) != 1)
+		{
+			journal_remove(jfd, path);
+		}
+		close(fd);
+	}
+	close(jfd);
 }
 
-void select_get_fileowner_or_check(unsigned long inode, uid_t owner)
+/*
+** Resume every conversion a crash interrupted, once kernel space knows the daemon again,
+** as only then does it transform the rewrites.
+*/
+void * resume_worker(void * arg)
 {
-	uid_t result = 0;
+	struct dirent * entry;
+	DIR * dir;
 
-	snprintf(sql, 63, SELECT2, inode);
-	rc = sqlite3_exec(db, sql, callback_get_fileowner_or_check, & result, NULL);
-	if (owner)	// for normal user check protection
+	while (! __atomic_load_n(kernel_ready, __ATOMIC_ACQUIRE))
 	{
-		rspbuf.stat = (owner == result) ? 0 : 4;
+		sleep(1);
 	}
-	else	// for root get owner
+	dir = opendir(JOURNAL_DIR);
+	if (! dir || store_open())
 	{
-		rspbuf.uid = (unsigned long)result;
+		if (dir)
+		{
+			closedir(dir);
+		}
+		return NULL;
 	}
-	if (rc != SQLITE_OK)
+	while ((entry = readdir(dir)))
 	{
-		rspbuf.stat = 1;
+		if (entry -> d_name[0] != '.')
+		{
+			resume(entry -> d_name);
+		}
 	}
-	send(client_sock, & rspbuf, rsp_len, 0);
+	closedir(dir);
+	store_close();
+
+	return NULL;
 }
 
-void insert(unsigned long inode, uid_t owner)
+int insert(struct client * client, unsigned long inode, uid_t owner)
 {
-	uid_t result = 0;
+	union rsp rsp;
+	uid_t result;
+	int rc;
 
-	snprintf(sql, 63, SELECT_CHECK, inode);
-	rc = sqlite3_exec(db, sql, callback_get_fileowner_or_check, & result, NULL);
+	result = (uid_t)store_value(SELECT2, inode, & rc);
 	if (result)	// check whether already in database
 	{
-		rspbuf.stat = 3;
+		rsp.stat = 3;
 	}
 	else
 	{
 		if (! owner)	// for root always succeed
 		{
-			rspbuf.stat = 0;
+			rsp.stat = 0;
 		}
 		else
 		{
-			if ( owner == get_owner_from_ino(inode) )	// check whether request from file owner
+			if ( owner == lookup_owner(inode) )	// check whether request from file owner
 			{
-				if (fork())
-				{
-					wait(& rspbuf.stat);
-				}
-				else	//drop privilege to file owner for encryption during insert
-				{
-					char filename[4096];
-					struct stat statbuf;
-					int status = 1;
-					get_filename_from_ino(inode, filename);
-					stat(filename, & statbuf);
-					if (S_ISREG(statbuf.st_mode))
-					{
-						FILE * f = fopen(filename, "rb+");
-						if (f)
-						{
-							fseek(f, 0, SEEK_END);
-							long fsize = ftell(f);
-							fseek(f, 0, SEEK_SET);
-							char * buffer = malloc(fsize + 1);
-							if (buffer)
-							{
-								seteuid(owner);
-								setbuf(f, NULL);
-								fread(buffer, 1, fsize, f);
-								buffer[fsize] = 0;
-								snprintf(sql, 63, INSERT, inode, owner);
-								rc = sqlite3_exec(db, sql, NULL, 0, NULL);
-								status = (rc == SQLITE_OK) ? 0 : 1;
-								fseek(f, 0, SEEK_SET);
-								fwrite(buffer, 1, fsize, f);
-								free(buffer);
-							}
-							fclose(f);
-						}
-					}
-					else
-					{
-						snprintf(sql, 63, INSERT, inode, owner);
-						rc = sqlite3_exec(db, sql, NULL, 0, NULL);
-						status = (rc == SQLITE_OK) ? 0 : 1;
-					}
-					exit(status);
-				}
+				rsp.stat = convert(inode, owner, 1);
 			}
 			else
 			{
-				rspbuf.stat = 5;
+				rsp.stat = 5;
 			}
 		}
 	}
-	send(client_sock, & rspbuf, rsp_len, 0);
+
+	return client_send(client, & rsp, sizeof(union rsp));
 }
 
-void delete(unsigned long inode, uid_t owner)
+int delete(struct client * client, unsigned long inode, uid_t owner)
 {
-	uid_t result = 0;
+	union rsp rsp;
+	uid_t result;
+	int rc;
 
-	snprintf(sql, 63, SELECT2, inode);
-	rc = sqlite3_exec(db, sql, callback_get_fileowner_or_check, & result, NULL);
+	result = (uid_t)store_value(SELECT2, inode, & rc);
 	if (! result)	// check whether not in database
 	{
-		rspbuf.stat = 3;
+		rsp.stat = 3;
 	}
 	else
 	{
 		if (! owner || owner == result)	// request from root or owner
 		{
-			if (fork())
-			{
-				wait(& rspbuf.stat);
-			}
-			else	//drop privilege to file owner for decryption during delete
-			{
-				char filename[4096];
-				struct stat statbuf;
-				int status = 1;
-				get_filename_from_ino(inode, filename);
-				stat(filename, & statbuf);
-				if (S_ISREG(statbuf.st_mode))
-				{
-					FILE * f = fopen(filename, "rb+");
-					if (f)
-					{
-						fseek(f, 0, SEEK_END);
-						long fsize = ftell(f);
-						fseek(f, 0, SEEK_SET);
-						char * buffer = malloc(fsize + 1);
-						if (buffer)
-						{
-							seteuid(result);
-							setbuf(f, NULL);
-							fread(buffer, 1, fsize, f);
-							buffer[fsize] = 0;
-							snprintf(sql, 63, DELETE, inode);
-							rc = sqlite3_exec(db, sql, NULL, 0, NULL);
-							status = (rc == SQLITE_OK) ? 0 : 1;
-							fseek(f, 0, SEEK_SET);
-							fwrite(buffer, 1, fsize, f);
-							free(buffer);
-						}
-						fclose(f);
-					}
-				}
-				else
-				{
-					snprintf(sql, 63, DELETE, inode);
-					rc = sqlite3_exec(db, sql, NULL, 0, NULL);
-					status = (rc == SQLITE_OK) ? 0 : 1;
-				}
-				exit(status);
-			}
+			rsp.stat = convert(inode, result, 0);
 		}
 		else
 		{
-			rspbuf.stat = 5;
+			rsp.stat = 5;
+		}
+	}
+
+	return client_send(client, & rsp, sizeof(union rsp));
+}
+
+/*
+** Wait for the next request of client, or for it to take its pending reply, or drop
+** it if done is set.
+*/
+void client_next(struct client * client, int done)
+{
+	struct epoll_event event;
+
+	event.events = (client -> out_len ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+	event.data.ptr = client;
+	if (done || epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client -> sock, & event) == -1)
+	{
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client -> sock, NULL);
+		close(client -> sock);
+		free(client);
+	}
+}
+
+/*
+** Worker thread serving the slow requests, that is file lists, inserts and deletes.
+*/
+void * client_worker(void * arg)
+{
+	struct client * client;
+	int ret = -1;
+
+	if (store_open())
+	{
+		return NULL;
+	}
+	while (1)
+	{
+		pthread_mutex_lock(& job_lock);
+		while (! job_head)
+		{
+			pthread_cond_wait(& job_cond, & job_lock);
+		}
+		client = job_head;
+		job_head = client -> next;
+		if (! job_head)
+		{
+			job_tail = & job_head;
+		}
+		pthread_mutex_unlock(& job_lock);
+
+		switch (client -> req.op)
+		{
+			case 1:	//send filelist
+				ret = select_get_filelist(client, client -> uid);
+				break;
+			case 4:	//send insert status
+				ret = insert(client, client -> req.ino, client -> uid);
+				break;
+			case 8:	//send delete status
+				ret = delete(client, client -> req.ino, client -> uid);
+				break;
+		}
+		client_next(client, ret || client -> req.op == 1);
+	}
+
+	return NULL;
+}
+
+/*
+** Accept every pending connection, noting the uid of its peer.
+*/
+void client_accept(void)
+{
+	struct client * client;
+	struct epoll_event event;
+	struct ucred cr;
+	socklen_t ucred_len = sizeof(struct ucred);
+	int sock;
+
+	while ((sock = accept4(server_sock, NULL, NULL, SOCK_NONBLOCK)) != -1)
+	{
+		client = calloc(1, sizeof(struct client));
+		/*
+		** Get socket peer identification.
+		*/
+		if (! client || getsockopt(sock, SOL_SOCKET, SO_PEERCRED, & cr, & ucred_len) == -1)
+		{
+			free(client);
+			close(sock);
+			continue;
+		}
+		client -> sock = sock;
+		client -> uid = cr.uid;
+		event.events = EPOLLIN | EPOLLONESHOT;
+		event.data.ptr = client;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, & event) == -1)
+		{
+			free(client);
+			close(sock);
 		}
 	}
-	send(client_sock, & rspbuf, rsp_len, 0);
+}
+
+/*
+** Read from client, and serve its request once complete: quick ones right away,
+** slow ones through the worker pool. A client with a pending reply is only written to.
+*/
+void client_read(struct client * client)
+{
+	ssize_t n;
+
+	if (client -> out_len)
+	{
+		client_next(client, client_flush(client));
+		return;
+	}
+	n = recv(client -> sock, (char *)& client -> req + client -> got, sizeof(struct req) - client -> got, 0);
+	if (n <= 0)
+	{
+		client_next(client, n == 0 || (errno != EAGAIN && errno != EINTR));
+		return;
+	}
+	client -> got += n;
+	if (client -> got < sizeof(struct req))
+	{
+		client_next(client, 0);
+		return;
+	}
+	client -> got = 0;
+	switch (client -> req.op)
+	{
+		case 2:	//send ownership
+			client_next(client, select_get_fileowner_or_check(client, client -> req.ino, client -> uid));
+			break;
+		case 1:
+		case 4:
+		case 8:
+			client -> next = NULL;
+			pthread_mutex_lock(& job_lock);
+			* job_tail = client;
+			job_tail = & client -> next;
+			pthread_cond_signal(& job_cond);
+			pthread_mutex_unlock(& job_lock);
+			break;
+		default:
+			client_next(client, 1);
+	}
 }
 
 /*
 ** This is the main processing function.
 ** It will create 2 processes, one handles requests from client side,
 ** the other handles communication from kernel space for control purposes.
+** Usage: safed [-w workers] [-c client_workers], where workers is the number of threads
+** answering kernel space, and client_workers the number serving slow client requests.
 */
 int main(int argc, char ** argv)
 {
-	int sockaddr_len, ucred_len;
-	struct sockaddr_un server_sockaddr, client_sockaddr;
-	struct ucred cr;
+	struct sockaddr_un server_sockaddr;
+	int opt, rc;
 
-	req_len = sizeof(struct req);
-	rsp_len = sizeof(union rsp);
-	rsp1_len = sizeof(struct rsp1);
-	sockaddr_len = sizeof(struct sockaddr_un);
-	ucred_len = sizeof(struct ucred);
-	memset(& server_sockaddr, 0, sockaddr_len);
-	memset(& client_sockaddr, 0, sockaddr_len);
+	workers = client_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "w:c:")) != -1)
+	{
+		if (opt == 'w')
+		{
+			workers = atoi(optarg);
+		}
+		else if (opt == 'c')
+		{
+			client_workers = atoi(optarg);
+		}
+	}
+	if (workers < 1)
+	{
+		workers = 1;
+	}
+	if (client_workers < 1)
+	{
+		client_workers = 1;
+	}
+	memset(& server_sockaddr, 0, sizeof(struct sockaddr_un));
 
-	rc = sqlite3_open(DB_PATH, & db);
-	if (rc)
+	if (store_open())
 	{
 		printf("%s\n", "SQLITE OPEN ERROR");
-		sqlite3_close(db);
 		exit(1);
 	}
-	chmod(DB_PATH, 0600);
-	rc = sqlite3_exec(db, CREATE, NULL, 0, NULL);
-	if (rc != SQLITE_OK)
+	mark_rows();
+	census_count = store_value(COUNT, 0, & rc);
+	census_unmarked = store_value(COUNT_UNMARKED, 0, & rc);
+	store_close();
+	mkdir(JOURNAL_DIR, 0700);
+	index_pushed = mmap(NULL, sizeof(unsigned long), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	kernel_ready = mmap(NULL, sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (pipe(index_pipe) == -1 || index_pushed == MAP_FAILED || kernel_ready == MAP_FAILED)
 	{
-		printf("%s\n", "CREATE TABLE ERROR");
-		sqlite3_close(db);
+		printf("%s\n", "PIPE ERROR");
 		exit(1);
 	}
 
@@ -324,6 +1475,18 @@ int main(int argc, char ** argv)
 		struct nlmsghdr * nlh = NULL;
 		struct msghdr msg;
 		struct iovec iov;
+		struct pollfd fds;
+		pthread_t thread;
+		int i;
+
+		close(index_pipe[1]);
+		fcntl(index_pipe[0], F_SETFL, O_NONBLOCK);
+		if (store_open())
+		{
+			printf("%s\n", "SQLITE OPEN ERROR");
+			exit(1);
+		}
+		load_index();
 
 		nlh = (struct nlmsghdr *)malloc(NLMSG_SPACE(sizeof(unsigned long)));
 		memset(& src_sockaddr, 0, sizeof(struct sockaddr_nl));
@@ -340,6 +1503,7 @@ int main(int argc, char ** argv)
 		dest_sockaddr.nl_pid = 0;
 		dest_sockaddr.nl_groups = 0;
 		nlh -> nlmsg_len = NLMSG_SPACE(sizeof(unsigned long));
+		nlh -> nlmsg_type = SAFE_MSG_READY;
 		nlh -> nlmsg_pid = getpid();
 		nlh -> nlmsg_flags = 0;
 		iov.iov_base = (void *)nlh;
@@ -350,29 +1514,85 @@ int main(int argc, char ** argv)
 		msg.msg_iovlen = 1;
 
 		/*
-		** First send a ready signal to kernel space.
+		** Map the shared memory rings if kernel space offers them; netlink serves otherwise.
+		*/
+		ring_fd = open(RING_PATH, O_RDWR);
+		if (ring_fd != -1)
+		{
+			ring_area = mmap(NULL, sizeof(struct ring_area), PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, 0);
+			if (ring_area == MAP_FAILED)
+			{
+				ring_area = NULL;
+				close(ring_fd);
+				ring_fd = -1;
+			}
+		}
+
+		/*
+		** Start the workers, which share the socket and the rings, then send a ready signal
+		** to kernel space.
 		*/
+		for (i = 0; i < workers; ++ i)
+		{
+			if (pthread_create(& thread, NULL, worker, NULL))
+			{
+				printf("%s\n", "THREAD ERROR");
+				exit(1);
+			}
+			pthread_detach(thread);
+		}
 		* (unsigned long *)NLMSG_DATA(nlh) = (unsigned long)0xffffffff << 32;
-		sendmsg(server_sock, & msg, 0);
+		if (sendmsg(server_sock, & msg, 0) == -1)
+		{
+			printf("%s\n", "READY ERROR");
+		}
+		else
+		{
+			publish_census(server_sock, census_count, census_unmarked);
+			__atomic_store_n(kernel_ready, 1, __ATOMIC_RELEASE);
+		}
+		fds.fd = index_pipe[0];
+		fds.events = POLLIN;
+		/*
+		** The main thread keeps the index current while the workers are idle.
+		*/
 		while (1)
 		{
-			recvmsg(server_sock, & msg, 0);
-			snprintf(sql, 63, SELECT2, * (unsigned long *)NLMSG_DATA(nlh));
-			* (unsigned long *)NLMSG_DATA(nlh) = 0;
-			sqlite3_exec(db, sql, callback_get_fileowner_or_check, (uid_t *)NLMSG_DATA(nlh), NULL);
-			sendmsg(server_sock, & msg, 0);
+			if (poll(& fds, 1, -1) > 0)
+			{
+				sync_index();
+			}
 		}
 
 		close(server_sock);
 		free(nlh);
-		sqlite3_close(db);
+		store_close();
 	}
 	/*
 	** Child process handles client communication.
 	*/
 	else
 	{
-		server_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+		struct epoll_event events[WORKER_BATCH];
+		pthread_t thread;
+		int n, i;
+
+		close(index_pipe[0]);
+		if (store_open())
+		{
+			printf("%s\n", "SQLITE OPEN ERROR");
+			exit(1);
+		}
+		/*
+		** Updates are sent from an autobound netlink socket, since the parent owns our pid.
+		*/
+		notify_sock = socket(AF_NETLINK, SOCK_RAW, NETLINK_SAFE);
+		if (notify_sock == -1)
+		{
+			printf("%s\n", "NETLINK SOCKET ERROR");
+			exit(1);
+		}
+		server_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
 		if (server_sock == -1)
 		{
 			printf("%s\n", "SOCKET ERROR");
@@ -381,7 +1601,7 @@ int main(int argc, char ** argv)
 		server_sockaddr.sun_family = AF_UNIX;
 		strcpy(server_sockaddr.sun_path, SOCK_PATH);
 		unlink(SOCK_PATH);
-		rc = bind(server_sock, (struct sockaddr *)& server_sockaddr, sockaddr_len);
+		rc = bind(server_sock, (struct sockaddr *)& server_sockaddr, sizeof(struct sockaddr_un));
 		if (rc == -1)
 		{
 			printf("%s\n", "BIND ERROR");
@@ -389,7 +1609,7 @@ int main(int argc, char ** argv)
 			exit(1);
 		}
 		chmod(SOCK_PATH, 0666);
-		rc = listen(server_sock, 16);
+		rc = listen(server_sock, SOMAXCONN);
 		if (rc == -1)
 		{
 			printf("%s\n", "LISTEN ERROR");
@@ -397,48 +1617,48 @@ int main(int argc, char ** argv)
 			exit(1);
 		}
 
-		while (1)
+		epoll_fd = epoll_create1(0);
+		events[0].events = EPOLLIN;
+		events[0].data.ptr = NULL;
+		if (epoll_fd == -1 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_sock, & events[0]) == -1)
 		{
-			client_sock = accept(server_sock, (struct sockaddr *)& client_sockaddr, & sockaddr_len);
-			if (client_sock == -1)
-			{
-				close(client_sock);
-				continue;
-			}
-			rc = recv(client_sock, & reqbuf, req_len, 0);
-			if (rc == -1)
-			{
-				close(client_sock);
-				continue;
-			}
-			/*
-			** Get socket peer identification.
-			*/
-			if (getsockopt(client_sock, SOL_SOCKET, SO_PEERCRED, & cr, & ucred_len) == -1)
+			printf("%s\n", "EPOLL ERROR");
+			close(server_sock);
+			exit(1);
+		}
+		for (i = 0; i < client_workers; ++ i)
+		{
+			if (pthread_create(& thread, NULL, client_worker, NULL))
 			{
-				close(client_sock);
-				continue;
+				printf("%s\n", "THREAD ERROR");
+				exit(1);
 			}
-			switch (reqbuf.op)
+			pthread_detach(thread);
+		}
+		if (! pthread_create(& thread, NULL, resume_worker, NULL))
+		{
+			pthread_detach(thread);
+		}
+		/*
+		** The main thread accepts connections and reads requests, and answers the quick ones.
+		*/
+		while (1)
+		{
+			n = epoll_wait(epoll_fd, events, WORKER_BATCH, -1);
+			for (i = 0; i < n; ++ i)
 			{
-				case 1:	//send filelist
-					select_get_filelist(cr.uid);
-					break;
-				case 2:	//send ownership
-					select_get_fileowner_or_check(reqbuf.ino, cr.uid);
-					break;
-				case 4:	//send insert status
-					insert(reqbuf.ino, cr.uid);
-					break;
-				case 8:	//send delete status
-					delete(reqbuf.ino, cr.uid);
-					break;
+				if (events[i].data.ptr)
+				{
+					client_read((struct client *)events[i].data.ptr);
+				}
+				else
+				{
+					client_accept();
+				}
 			}
-			close(client_sock);
 		}
 		close(server_sock);
-		close(client_sock);
-		sqlite3_close(db);
+		store_close();
 	}
 
 	return 0;
@@ -0,0 +1,258 @@
+/*
+** Storage layer of the safe table.
+** The database runs in WAL mode with synchronous = NORMAL, so readers never wait for the
+** writer and a commit costs no fsync, and is read through mmap. Every statement is
+** prepared once per connection and kept in stmts, indexed by enum stmt.
+** The schema is versioned through user_version, and store_open migrates older databases.
+** A connection must neither cross fork() nor be shared between threads, so every thread
+** which uses the table opens its own, and the statement cache is per thread as well.
+*/
+#include <sqlite3.h>
+#include <sys/stat.h>
+
+#define DB_PATH "/var/tmp/safe.db"
+#define DB_MMAP_SIZE (256UL << 20)
+#define DB_BUSY_TIMEOUT 5000
+#define CREATE "CREATE TABLE IF NOT EXISTS safe"\
+			"("									\
+				"inode INTEGER PRIMARY KEY,"	\
+				"owner INTEGER,"				\
+				"marked INTEGER DEFAULT 0"		\
+			")"
+
+/*
+** Migrations, migrations[i] taking the schema from version i to i + 1.
+** Tables created before markers existed lack the marked column; store_migrate adds it only then.
+*/
+static const char * const migrations[] =
+{
+	"ALTER TABLE safe ADD COLUMN marked INTEGER DEFAULT 0",
+	"CREATE INDEX IF NOT EXISTS safe_owner ON safe(owner)",
+	"CREATE INDEX IF NOT EXISTS safe_unmarked ON safe(inode) WHERE marked = 0",
+};
+
+enum stmt
+{
+	SELECT1,
+	SELECT1_ROOT,
+	SELECT2,
+	INSERT,
+	MARK,
+	SELECT_MARKED,
+	SELECT_UNMARKED,
+	DELETE,
+	COUNT,
+	COUNT_UNMARKED,
+	BEGIN,
+	COMMIT,
+	ROLLBACK,
+	STMT_MAX
+};
+
+static const char * const stmt_sql[STMT_MAX] =
+{
+	[SELECT1] = "SELECT inode FROM safe WHERE owner = ?",
+	[SELECT1_ROOT] = "SELECT inode, owner FROM safe",
+	[SELECT2] = "SELECT owner FROM safe WHERE inode = ?",
+	[INSERT] = "INSERT INTO safe VALUES (?, ?, 0)",
+	[MARK] = "UPDATE safe SET marked = 1 WHERE inode = ?",
+	[SELECT_MARKED] = "SELECT marked FROM safe WHERE inode = ?",
+	[SELECT_UNMARKED] = "SELECT inode, owner FROM safe WHERE marked = 0",
+	[DELETE] = "DELETE FROM safe WHERE inode = ?",
+	[COUNT] = "SELECT COUNT(*) FROM safe",
+	[COUNT_UNMARKED] = "SELECT COUNT(*) FROM safe WHERE marked = 0",
+	[BEGIN] = "BEGIN IMMEDIATE",
+	[COMMIT] = "COMMIT",
+	[ROLLBACK] = "ROLLBACK",
+};
+
+__thread sqlite3 * db;
+static __thread sqlite3_stmt * stmts[STMT_MAX];
+
+/*
+** Read one integer from a single row query into value; return 0 on success, or -1.
+** A query which yields no row leaves value alone.
+*/
+static int store_pragma(const char * sql, int * value)
+{
+	sqlite3_stmt * stmt;
+	int rc;
+
+	if (sqlite3_prepare_v2(db, sql, -1, & stmt, NULL) != SQLITE_OK)
+	{
+		return -1;
+	}
+	rc = sqlite3_step(stmt);
+	if (rc == SQLITE_ROW)
+	{
+		* value = sqlite3_column_int(stmt, 0);
+	}
+	sqlite3_finalize(stmt);
+
+	return (rc == SQLITE_ROW || rc == SQLITE_DONE) ? 0 : -1;
+}
+
+/*
+** Bring the schema up to date, each step in its own transaction. The version is read
+** within that transaction, so a step another connection has taken meanwhile is not redone.
+** Tables created by CREATE already have the marked column, so step 0 only adds it if missing.
+*/
+static int store_migrate(void)
+{
+	char pragma[48];
+	int version, marked;
+
+	for (;;)
+	{
+		if (sqlite3_exec(db, "BEGIN IMMEDIATE", NULL, 0, NULL) != SQLITE_OK)
+		{
+			return -1;
+		}
+		version = 0;
+		if (store_pragma("PRAGMA user_version", & version))
+		{
+			break;
+		}
+		if (version >= (int)(sizeof(migrations) / sizeof(migrations[0])))
+		{
+			sqlite3_exec(db, "ROLLBACK", NULL, 0, NULL);
+			return 0;
+		}
+		marked = 0;
+		if (! version && store_pragma("SELECT COUNT(*) FROM pragma_table_info('safe') WHERE name = 'marked'", & marked))
+		{
+			break;
+		}
+		if (! marked && sqlite3_exec(db, migrations[version], NULL, 0, NULL) != SQLITE_OK)
+		{
+			break;
+		}
+		snprintf(pragma, sizeof(pragma), "PRAGMA user_version = %d", version + 1);
+		if (sqlite3_exec(db, pragma, NULL, 0, NULL) != SQLITE_OK
+			|| sqlite3_exec(db, "COMMIT", NULL, 0, NULL) != SQLITE_OK)
+		{
+			break;
+		}
+	}
+	sqlite3_exec(db, "ROLLBACK", NULL, 0, NULL);
+
+	return -1;
+}
+
+/*
+** Open the connection of the calling thread, creating and migrating the database as
+** needed; return 0 on success, or -1.
+*/
+int store_open(void)
+{
+	char pragma[64];
+
+	if (sqlite3_open(DB_PATH, & db) != SQLITE_OK)
+	{
+		sqlite3_close(db);
+		return -1;
+	}
+	chmod(DB_PATH, 0600);
+	sqlite3_busy_timeout(db, DB_BUSY_TIMEOUT);
+	sqlite3_exec(db, "PRAGMA journal_mode = WAL", NULL, 0, NULL);
+	sqlite3_exec(db, "PRAGMA synchronous = NORMAL", NULL, 0, NULL);
+	snprintf(pragma, sizeof(pragma), "PRAGMA mmap_size = %lu", DB_MMAP_SIZE);
+	sqlite3_exec(db, pragma, NULL, 0, NULL);
+	if (sqlite3_exec(db, CREATE, NULL, 0, NULL) != SQLITE_OK || store_migrate())
+	{
+		sqlite3_close(db);
+		return -1;
+	}
+
+	return 0;
+}
+
+void store_close(void)
+{
+	int i;
+
+	for (i = 0; i < STMT_MAX; ++ i)
+	{
+		sqlite3_finalize(stmts[i]);
+		stmts[i] = NULL;
+	}
+	sqlite3_close(db);
+}
+
+/*
+** Return statement id ready to run, with its first two parameters (if any) bound to a
+** and b, or NULL if it cannot be prepared.
+*/
+sqlite3_stmt * store_stmt(enum stmt id, sqlite3_int64 a, sqlite3_int64 b)
+{
+	sqlite3_stmt * stmt = stmts[id];
+	int params;
+
+	if (stmt)
+	{
+		sqlite3_reset(stmt);
+	}
+	else if (sqlite3_prepare_v3(db, stmt_sql[id], -1, SQLITE_PREPARE_PERSISTENT, & stmt, NULL) == SQLITE_OK)
+	{
+		stmts[id] = stmt;
+	}
+	else
+	{
+		return NULL;
+	}
+	params = sqlite3_bind_parameter_count(stmt);
+	if (params > 0)
+	{
+		sqlite3_bind_int64(stmt, 1, a);
+	}
+	if (params > 1)
+	{
+		sqlite3_bind_int64(stmt, 2, b);
+	}
+
+	return stmt;
+}
+
+/*
+** Run statement id, which returns no rows; return SQLITE_OK on success.
+*/
+int store_exec(enum stmt id, sqlite3_int64 a, sqlite3_int64 b)
+{
+	sqlite3_stmt * stmt = store_stmt(id, a, b);
+	int rc;
+
+	if (! stmt)
+	{
+		return SQLITE_ERROR;
+	}
+	rc = sqlite3_step(stmt);
+	sqlite3_reset(stmt);
+
+	return (rc == SQLITE_DONE || rc == SQLITE_ROW) ? SQLITE_OK : rc;
+}
+
+/*
+** Return the first column of the first row of statement id as an integer, 0 if none;
+** rc tells whether the query worked.
+*/
+sqlite3_int64 store_value(enum stmt id, sqlite3_int64 a, int * rc)
+{
+	sqlite3_stmt * stmt = store_stmt(id, a, 0);
+	sqlite3_int64 value = 0;
+	int ret;
+
+	if (! stmt)
+	{
+		* rc = SQLITE_ERROR;
+		return 0;
+	}
+	ret = sqlite3_step(stmt);
+	if (ret == SQLITE_ROW)
+	{
+		value = sqlite3_column_int64(stmt, 0);
+	}
+	* rc = (ret == SQLITE_ROW || ret == SQLITE_DONE) ? SQLITE_OK : ret;
+	sqlite3_reset(stmt);
+
+	return value;
+}